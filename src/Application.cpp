@@ -24,11 +24,14 @@
 
 #include <Wt/Dbo/Dbo.h>
 
+#include "PuzzleRouter.h"
+
 #include "model/Puzzle.h"
 #include "model/User.h"
 #include "widgets/PuzzleView.h"
 #include "widgets/PuzzleUploader.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 
@@ -37,12 +40,14 @@ namespace swedish {
 Application::Application(const Wt::WEnvironment &env,
                          Wt::Dbo::SqlConnectionPool &pool,
                          SharedSession &sharedSession,
-                         Dispatcher &dispatcher)
+                         Dispatcher &dispatcher,
+                         const PuzzleRouter *puzzleRouter)
   : WApplication(env),
-    session_(pool),
+    session_(pool, sharedSession.userRegistry()),
     sharedSession_(sharedSession),
     dispatcher_(dispatcher),
-    subscriber_(sessionId()),
+    puzzleRouter_(puzzleRouter),
+    subscriber_(std::make_shared<Subscriber>(sessionId())),
     layout_(nullptr),
     rightLayout_(nullptr),
     left_(nullptr),
@@ -52,8 +57,9 @@ Application::Application(const Wt::WEnvironment &env,
 {
   enableUpdates();
 
-  subscriber_.userAdded().connect(this, &Application::handleUserAdded);
-  subscriber_.userChangedColor().connect(this, &Application::handleUserChangedColor);
+  subscriber_->userAdded().connect(this, &Application::handleUserAdded);
+  subscriber_->userChangedColor().connect(this, &Application::handleUserChangedColor);
+  subscriber_->resync().connect(this, &Application::handleResync);
 
   messageResourceBundle().use(appRoot() + "template");
   messageResourceBundle().use(appRoot() + "strings");
@@ -80,28 +86,7 @@ Application::Application(const Wt::WEnvironment &env,
   userList_ = usersPanel->setCentralWidget(std::make_unique<Wt::WContainerWidget>());
   userList_->setList(true);
 
-  {
-    Wt::Dbo::Transaction t(session_);
-
-    {
-      Wt::Dbo::collection<Wt::Dbo::ptr<User>> users = session_.find<User>().orderBy("id");
-
-      for (const auto &user: users) {
-        users_.push_back({user.id(), user->name, user->color});
-      }
-    }
-  }
-
-  Wt::WFont font;
-  font.setFamily(Wt::FontFamily::SansSerif);
-  font.setSize(16);
-  font.setWeight(Wt::FontWeight::Bold);
-  for (auto&& user : users_) {
-    auto c = userList_->addNew<Wt::WContainerWidget>();
-    c->addNew<Wt::WText>(user.name, Wt::TextFormat::Plain);
-    c->decorationStyle().setFont(font);
-    c->decorationStyle().setForegroundColor(user.color);
-  }
+  loadUsers();
 
   rightLayout_ = layout_->addLayout(std::make_unique<Wt::WVBoxLayout>(), 1);
   rightLayout_->setContentsMargins(3, 3, 3, 3);
@@ -154,14 +139,22 @@ Application::Application(const Wt::WEnvironment &env,
   if (puzzleId == -1) {
     Wt::Dbo::Transaction t(session_);
 
-    auto puzzle = session_.find<Puzzle>().orderBy("id desc").limit(1).resultValue();
-    if (puzzle) {
-      puzzleId = puzzle.id();
+    // only the id, so a puzzle that fails to load doesn't stop the application from starting
+    Wt::Dbo::collection<long long> ids = session_.query<long long>("select id from puzzles")
+        .orderBy("id desc")
+        .limit(1);
+    for (const long long id : ids) {
+      puzzleId = id;
     }
   }
 
   changePuzzle(puzzleId);
 
+  Wt::WFont font;
+  font.setFamily(Wt::FontFamily::SansSerif);
+  font.setSize(16);
+  font.setWeight(Wt::FontWeight::Bold);
+
   auto chooseUserDialog = addChild(std::make_unique<Wt::WDialog>(Wt::utf8("Choose user")));
 
   for (auto&& user : users_) {
@@ -198,7 +191,7 @@ Application::Application(const Wt::WEnvironment &env,
       session_.flush();
       user_ = userPtr.id();
     }
-    dispatcher_.get().notifyUserAdded(subscriber_, user_, name, color);
+    dispatcher_.get().notifyUserAdded(*subscriber_, user_, name, color);
     handleUserAdded(user_, name, color);
     left_->addWidget(createChangeColorPanel(color));
     chooseUserDialog->done(Wt::DialogCode::Accepted);
@@ -246,14 +239,14 @@ void Application::initialize()
 void Application::finalize()
 {
   if (user_ != -1) {
-    dispatcher_.get().notifyCursorMoved(subscriber_,
+    dispatcher_.get().notifyCursorMoved(*subscriber_,
                                         -1,
                                         user_,
                                         std::pair(-1, -1),
                                         Wt::Orientation::Horizontal);
   }
 
-  dispatcher_.get().removeSubscriber(subscriber_);
+  dispatcher_.get().removeSubscriber(*subscriber_);
 }
 
 std::unique_ptr<Wt::WPanel> Application::createChangeColorPanel(const Wt::WColor &color)
@@ -275,7 +268,7 @@ std::unique_ptr<Wt::WPanel> Application::createChangeColorPanel(const Wt::WColor
       user.modify()->color = color;
     }
 
-    dispatcher_.get().notifyUserChangedColor(subscriber_, user_, color);
+    dispatcher_.get().notifyUserChangedColor(*subscriber_, user_, color);
 
     handleUserChangedColor(user_, color);
   });
@@ -288,6 +281,7 @@ void Application::handleUserAdded(long long id,
                                   const Wt::WColor &color)
 {
   users_.push_back({id, name, color});
+  setUserPen(id, color);
 
   Wt::WFont font;
   font.setFamily(Wt::FontFamily::SansSerif);
@@ -298,7 +292,51 @@ void Application::handleUserAdded(long long id,
   c->decorationStyle().setFont(font);
   c->decorationStyle().setForegroundColor(color);
 
-  triggerUpdate();
+  // user events are handled after cell edits, which may already have been
+  // painted without the pen of this user
+  if (puzzleView_) {
+    puzzleView_->update();
+  }
+}
+
+void Application::handleResync()
+{
+  // events were dropped, users may have been added or changed color
+  loadUsers();
+
+  if (puzzleView_) {
+    puzzleView_->resync();
+  }
+}
+
+void Application::loadUsers()
+{
+  users_.clear();
+  userList_->clear();
+
+  {
+    Wt::Dbo::Transaction t(session_);
+
+    {
+      Wt::Dbo::collection<Wt::Dbo::ptr<User>> users = session_.find<User>().orderBy("id");
+
+      for (const auto &user: users) {
+        users_.push_back({user.id(), user->name, user->color});
+        setUserPen(user.id(), user->color);
+      }
+    }
+  }
+
+  Wt::WFont font;
+  font.setFamily(Wt::FontFamily::SansSerif);
+  font.setSize(16);
+  font.setWeight(Wt::FontWeight::Bold);
+  for (auto&& user : users_) {
+    auto c = userList_->addNew<Wt::WContainerWidget>();
+    c->addNew<Wt::WText>(user.name, Wt::TextFormat::Plain);
+    c->decorationStyle().setFont(font);
+    c->decorationStyle().setForegroundColor(user.color);
+  }
 }
 
 void Application::handleUserChangedColor(long long id,
@@ -311,6 +349,7 @@ void Application::handleUserChangedColor(long long id,
     return; // TODO(Roel): error!
 
   it->color = color;
+  setUserPen(id, color);
 
   int userIdx = static_cast<int>(std::distance(begin(users_), it));
   auto w = userList_->widget(userIdx);
@@ -319,20 +358,61 @@ void Application::handleUserChangedColor(long long id,
   if (puzzleView_) {
     puzzleView_->update();
   }
+}
+
+void Application::requireJavaScriptFunction(const std::string &name,
+                                            const std::string &function)
+{
+  if (std::find(begin(javaScriptFunctions_), end(javaScriptFunctions_), name) != end(javaScriptFunctions_))
+    return;
+
+  declareJavaScriptFunction(name, function);
+  javaScriptFunctions_.push_back(name);
+}
+
+const Wt::WPen &Application::userPen(UserRegistry::Index index) const
+{
+  static const Wt::WPen black(Wt::StandardColor::Black);
+
+  if (index >= userPens_.size())
+    return black;
+
+  return userPens_[index];
+}
+
+void Application::setUserPen(long long id,
+                             const Wt::WColor &color)
+{
+  const UserRegistry::Index index = sharedSession_.get().userRegistry().indexOf(id);
+
+  if (index >= userPens_.size())
+    userPens_.resize(index + 1u, Wt::WPen(Wt::StandardColor::Black));
 
-  triggerUpdate();
+  userPens_[index] = Wt::WPen(color);
 }
 
 void Application::changePuzzle(long long id)
 {
-  Wt::Dbo::Transaction t(session_);
+  if (puzzleRouter_ &&
+      !puzzleRouter_->isLocal(id)) {
+    Wt::Dbo::Transaction t(session_);
+    const int count = session_.query<int>("select count(1) from puzzles").where("id = ?").bind(id).resultValue();
+    if (count > 0) {
+      // another process owns this puzzle, continue there
+      redirect(puzzleRouter_->url(id));
+      quit();
+      return;
+    }
+  }
 
-  Wt::Dbo::ptr<Puzzle> puzzle;
+  // the geometry is loaded once and shared with the other sessions,
+  // the cell states come from the shared session as well
+  std::shared_ptr<const PuzzleGeometry> geometry;
   try {
-    puzzle = session_.load<Puzzle>(id);
+    geometry = sharedSession_.get().geometry(id);
   } catch (Wt::Dbo::Exception &) { }
 
-  if (!puzzle) {
+  if (!geometry) {
     if (currentPuzzle_ == -1) {
       setInternalPath("/");
       puzzleEdit_->setText(Wt::WString::Empty);
@@ -341,13 +421,19 @@ void Application::changePuzzle(long long id)
     }
     return;
   } else {
-    puzzleEdit_->setText(Wt::utf8("{1}").arg(puzzle.id()));
+    puzzleEdit_->setText(Wt::utf8("{1}").arg(id));
   }
 
   currentPuzzle_ = id;
+  dispatcher_.get().subscribeToPuzzle(subscriber_, currentPuzzle_);
   puzzleContainer_->clear();
   puzzleView_ = nullptr;
-  puzzleView_ = puzzleContainer_->addNew<PuzzleView>(puzzle, PuzzleViewType::SolvePuzzle);
+  // client side rendering needs JavaScript
+  std::string clientRendering;
+  const PuzzleRendering rendering = environment().ajax() &&
+                                    readConfigurationProperty("client_rendering", clientRendering) &&
+                                    clientRendering == "true" ? PuzzleRendering::Client : PuzzleRendering::Server;
+  puzzleView_ = puzzleContainer_->addNew<PuzzleView>(id, std::move(geometry), rendering);
   puzzleView_->resize(Wt::WLength(100, Wt::LengthUnit::Percentage),
                       Wt::WLength(100, Wt::LengthUnit::Percentage));
   setInternalPath("/" + std::to_string(currentPuzzle_));
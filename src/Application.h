@@ -5,19 +5,24 @@
 #pragma once
 
 #include <Wt/WApplication.h>
+#include <Wt/WPen.h>
 
 #include "Dispatcher.h"
 #include "SharedSession.h"
 #include "UserCopy.h"
+#include "UserRegistry.h"
 
 #include "model/User.h"
 #include "model/Session.h"
 
 #include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace swedish {
 
+class PuzzleRouter;
 class PuzzleUploader;
 class PuzzleView;
 
@@ -26,7 +31,8 @@ public:
   Application(const Wt::WEnvironment &env,
               Wt::Dbo::SqlConnectionPool &pool,
               SharedSession &sharedSession,
-              Dispatcher &dispatcher);
+              Dispatcher &dispatcher,
+              const PuzzleRouter *puzzleRouter);
 
   ~Application() override;
 
@@ -36,13 +42,22 @@ public:
   long long user() const { return user_; }
   const std::vector<UserCopy> &users() const { return users_; }
 
+  // the pen for the given user, indexed like the UserRegistry,
+  // black if the user is unknown
+  const Wt::WPen &userPen(UserRegistry::Index index) const;
+
   SharedSession &sharedSession() { return sharedSession_; }
   const SharedSession &sharedSession() const { return sharedSession_; }
 
   Dispatcher &dispatcher() { return dispatcher_; }
   const Dispatcher &dispatcher() const { return dispatcher_; }
 
-  Subscriber &subscriber() { return subscriber_; }
+  Subscriber &subscriber() { return *subscriber_; }
+
+  // Declares the JavaScript function on javaScriptClass(), unless it was
+  // already declared. Widgets that need it can be created many times.
+  void requireJavaScriptFunction(const std::string &name,
+                                 const std::string &function);
 
   static Application *instance() { return dynamic_cast<Application *>(Wt::WApplication::instance()); }
 
@@ -50,18 +65,21 @@ private:
   Session session_;
   std::reference_wrapper<SharedSession> sharedSession_;
   std::reference_wrapper<Dispatcher> dispatcher_;
-  Subscriber subscriber_;
+  const PuzzleRouter *puzzleRouter_; // nullptr if puzzles are not sharded
+  std::shared_ptr<Subscriber> subscriber_; // shared with the Dispatcher
   Wt::WHBoxLayout *layout_;
   Wt::WVBoxLayout *rightLayout_;
   Wt::WContainerWidget *left_;
   Wt::WContainerWidget *userList_;
   long long user_ = -1;
   std::vector<UserCopy> users_;
+  std::vector<Wt::WPen> userPens_; // by UserRegistry::Index
   long long currentPuzzle_ = -1;
   Wt::WContainerWidget *puzzleContainer_ = nullptr;
   PuzzleView *puzzleView_  = nullptr;
   PuzzleUploader *puzzleUploader_ = nullptr;
   Wt::WLineEdit *puzzleEdit_ = nullptr;
+  std::vector<std::string> javaScriptFunctions_; // declared so far
 
   std::unique_ptr<Wt::WPanel> createChangeColorPanel(const Wt::WColor &color);
 
@@ -72,6 +90,13 @@ private:
   void handleUserChangedColor(long long id,
                               const Wt::WColor &color);
 
+  void handleResync();
+
+  void loadUsers();
+
+  void setUserPen(long long id,
+                  const Wt::WColor &color);
+
   void changePuzzle(long long id);
 };
 
@@ -0,0 +1,161 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "CellStates.h"
+
+#include <cassert>
+
+namespace {
+
+constexpr const std::uint64_t characterMask = 0x1F;
+constexpr const int userShift = 5;
+constexpr const std::uint64_t userMask = 0xFFFF;
+constexpr const int versionShift = 32;
+
+constexpr std::uint64_t pack(swedish::Character character,
+                             swedish::UserRegistry::Index user,
+                             std::uint32_t version) noexcept
+{
+  return static_cast<std::uint64_t>(character) |
+         (static_cast<std::uint64_t>(user) << userShift) |
+         (static_cast<std::uint64_t>(version) << versionShift);
+}
+
+constexpr swedish::Character unpackCharacter(std::uint64_t word) noexcept
+{
+  return static_cast<swedish::Character>(word & characterMask);
+}
+
+constexpr swedish::UserRegistry::Index unpackUser(std::uint64_t word) noexcept
+{
+  return static_cast<swedish::UserRegistry::Index>((word >> userShift) & userMask);
+}
+
+constexpr std::uint32_t unpackVersion(std::uint64_t word) noexcept
+{
+  return static_cast<std::uint32_t>(word >> versionShift);
+}
+
+}
+
+namespace swedish {
+
+std::vector<std::pair<Character, long long>> GridSnapshot::values() const
+{
+  std::vector<std::pair<Character, long long>> result;
+  result.reserve(cells.size());
+  for (const auto &cell : cells) {
+    result.emplace_back(cell.first, userRegistry->userId(cell.second));
+  }
+  return result;
+}
+
+CellStates::CellStates(const Puzzle &puzzle,
+                       UserRegistry &userRegistry)
+  : rowCount_(puzzle.grid_.rowCount()),
+    colCount_(puzzle.grid_.colCount()),
+    userRegistry_(userRegistry),
+    sequence_(0)
+{
+  words_ = std::make_unique<std::atomic<std::uint64_t>[]>(static_cast<std::size_t>(rowCount_ * colCount_));
+
+  for (int r = 0; r < rowCount_; ++r) {
+    for (int c = 0; c < colCount_; ++c) {
+      word({r, c}).store(pack(puzzle.grid_.character({r, c}),
+                              puzzle.grid_.userIndex({r, c}), // the grid uses the same registry
+                              0),
+                         std::memory_order_relaxed);
+    }
+  }
+}
+
+CellStates::~CellStates() = default;
+
+std::pair<Character, long long> CellStates::charAt(std::pair<int, int> cellRef) const
+{
+  const std::uint64_t w = word(cellRef).load(std::memory_order_acquire);
+
+  return { unpackCharacter(w), userRegistry_.userId(unpackUser(w)) };
+}
+
+CellValue CellStates::valueAt(std::pair<int, int> cellRef) const
+{
+  const std::uint64_t w = word(cellRef).load(std::memory_order_acquire);
+
+  return { unpackCharacter(w), unpackUser(w), unpackVersion(w) };
+}
+
+std::uint64_t CellStates::version() const
+{
+  return sequence_.load(std::memory_order_acquire) / 2;
+}
+
+std::shared_ptr<const GridSnapshot> CellStates::snapshot() const
+{
+  auto current = std::atomic_load(&snapshot_);
+  if (current && current->version == version())
+    return current;
+
+  auto result = std::make_shared<GridSnapshot>();
+  result->rowCount = rowCount_;
+  result->colCount = colCount_;
+  result->userRegistry = &userRegistry_;
+  result->cells.resize(static_cast<std::size_t>(rowCount_ * colCount_));
+
+  for (;;) {
+    const std::uint64_t before = sequence_.load(std::memory_order_acquire);
+    if (before % 2 != 0)
+      continue; // store in progress
+
+    for (std::size_t i = 0; i < result->cells.size(); ++i) {
+      const std::uint64_t w = words_[i].load(std::memory_order_relaxed);
+      result->cells[i] = { unpackCharacter(w), unpackUser(w) };
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence_.load(std::memory_order_relaxed) == before) {
+      result->version = before / 2;
+      break;
+    }
+  }
+
+  // don't replace a newer snapshot that another reader made in the meantime
+  current = std::atomic_load(&snapshot_);
+  if (!current || current->version < result->version)
+    std::atomic_store(&snapshot_, std::shared_ptr<const GridSnapshot>(result));
+
+  return result;
+}
+
+bool CellStates::store(std::pair<int, int> cellRef,
+                       Character character,
+                       long long user)
+{
+  std::atomic<std::uint64_t> &w = word(cellRef);
+
+  // only one writer at a time, so a relaxed load sees the latest store
+  const std::uint64_t old = w.load(std::memory_order_relaxed);
+
+  if (unpackCharacter(old) == character)
+    return false;
+
+  const std::uint64_t updated = pack(character, userRegistry_.indexOf(user), unpackVersion(old) + 1);
+
+  const std::uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+  sequence_.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  w.store(updated, std::memory_order_release);
+  sequence_.store(sequence + 2, std::memory_order_release);
+  return true;
+}
+
+std::atomic<std::uint64_t> &CellStates::word(std::pair<int, int> cellRef) const
+{
+  assert(cellRef.first >= 0 && cellRef.first < rowCount_ &&
+         cellRef.second >= 0 && cellRef.second < colCount_);
+
+  return words_[static_cast<std::size_t>(cellRef.first * colCount_ + cellRef.second)];
+}
+
+}
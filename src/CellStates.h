@@ -0,0 +1,90 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include "UserRegistry.h"
+
+#include "model/Puzzle.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace swedish {
+
+// An immutable copy of the state of all cells of a puzzle, taken at one version.
+// Users are kept as their index in the UserRegistry.
+struct GridSnapshot final {
+  std::uint64_t version = 0;
+  int rowCount = 0;
+  int colCount = 0;
+  const UserRegistry *userRegistry = nullptr;
+  std::vector<std::pair<Character, UserRegistry::Index>> cells; // row major
+
+  // returns (character, userid) for all cells, row major
+  std::vector<std::pair<Character, long long>> values() const;
+};
+
+// The state of one cell, as stored in CellStates
+struct CellValue final {
+  Character character = Character::None;
+  UserRegistry::Index user = UserRegistry::noUser;
+  std::uint32_t version = 0; // incremented on every store to the cell
+};
+
+// The mutable state of all cells of one puzzle, as a flat array of packed words:
+//
+//   bits  0 -  4: character
+//   bits  5 - 20: user index (see UserRegistry)
+//   bits 32 - 63: version, incremented on every store
+//
+// Reads are lock free. Stores are published with release semantics, but there
+// may only be one writer at a time (SharedSession holds its lock when writing).
+//
+// The puzzle as a whole also has a version, which counts the stores. It doubles as
+// a sequence lock, so snapshot() can take a consistent copy without locking.
+class CellStates final {
+public:
+  CellStates(const Puzzle &puzzle, UserRegistry &userRegistry);
+  ~CellStates();
+
+  CellStates(const CellStates &) = delete;
+  CellStates &operator=(const CellStates &) = delete;
+
+  int rowCount() const { return rowCount_; }
+  int colCount() const { return colCount_; }
+
+  // returns (character, userid)
+  std::pair<Character, long long> charAt(std::pair<int, int> cellRef) const;
+
+  // the character, user index and version of the cell, read at once
+  CellValue valueAt(std::pair<int, int> cellRef) const;
+
+  // the number of stores so far, only ever increases
+  std::uint64_t version() const;
+
+  // returns a consistent copy of all cells, shared with other readers
+  // as long as nothing changes
+  std::shared_ptr<const GridSnapshot> snapshot() const;
+
+  // returns true if the value was changed
+  bool store(std::pair<int, int> cellRef,
+             Character character,
+             long long user);
+
+private:
+  int rowCount_;
+  int colCount_;
+  UserRegistry &userRegistry_;
+  std::unique_ptr<std::atomic<std::uint64_t>[]> words_;
+  std::atomic<std::uint64_t> sequence_; // odd while a store is in progress
+  mutable std::shared_ptr<const GridSnapshot> snapshot_; // use std::atomic_load/store
+
+  std::atomic<std::uint64_t> &word(std::pair<int, int> cellRef) const;
+};
+
+}
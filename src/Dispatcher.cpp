@@ -4,31 +4,134 @@
 
 #include "Dispatcher.h"
 
+#include "Replicator.h"
+
+#include <Wt/WApplication.h>
+#include <Wt/WLogger.h>
 #include <Wt/WServer.h>
 
 #include <algorithm>
 
+namespace {
+
+// about one animation frame
+constexpr const std::chrono::milliseconds cursorCoalesceInterval(30);
+
+constexpr const std::size_t defaultInboxCapacity = 500;
+
+}
+
 namespace swedish {
 
-Dispatcher::Dispatcher(Wt::WServer *server)
-  : server_(server)
+Dispatcher::Dispatcher(Wt::WServer *server,
+                       UserRegistry &userRegistry)
+  : server_(server),
+    userRegistry_(userRegistry),
+    inboxCapacity_(defaultInboxCapacity),
+    overflows_(0),
+    subscribers_(std::make_shared<const SubscriberList>()),
+    puzzleSubscribers_(std::make_shared<const PuzzleSubscribers>()),
+    cursorTimer_(server->ioService())
 { }
 
-void Dispatcher::addSubsriber(Subscriber &subscriber)
+DispatcherStats Dispatcher::stats() const
+{
+  const auto subscribers = std::atomic_load(&subscribers_);
+
+  DispatcherStats result;
+  result.subscribers = subscribers->size();
+  for (const auto &subscriber : *subscribers) {
+    const std::size_t size = subscriber->inboxSize();
+    result.queuedEvents += size;
+    result.maxQueuedEvents = std::max(result.maxQueuedEvents, size);
+  }
+  result.overflows = overflows_;
+
+  return result;
+}
+
+void Dispatcher::addSubsriber(const std::shared_ptr<Subscriber> &subscriber)
 {
   std::scoped_lock<std::mutex> lock(subscriberMutex_);
-  subscribers_.emplace_back(subscriber);
+
+  auto subscribers = std::make_shared<SubscriberList>(*subscribers_);
+  subscribers->push_back(subscriber);
+  std::atomic_store(&subscribers_, std::shared_ptr<const SubscriberList>(std::move(subscribers)));
 }
 
 void Dispatcher::removeSubscriber(Subscriber &subscriber)
 {
   std::scoped_lock<std::mutex> lock(subscriberMutex_);
 
-  auto it = std::find_if(begin(subscribers_), end(subscribers_), [&subscriber](auto &s) {
-    return &s.get() == &subscriber;
+  unsubscribeFromPuzzle(subscriber);
+
+  auto subscribers = std::make_shared<SubscriberList>(*subscribers_);
+  auto it = std::find_if(begin(*subscribers), end(*subscribers), [&subscriber](auto &s) {
+    return s.get() == &subscriber;
   });
-  if (it != end(subscribers_))
-    subscribers_.erase(it);
+  if (it == end(*subscribers))
+    return;
+
+  subscribers->erase(it);
+  std::atomic_store(&subscribers_, std::shared_ptr<const SubscriberList>(std::move(subscribers)));
+}
+
+void Dispatcher::subscribeToPuzzle(const std::shared_ptr<Subscriber> &subscriber, long long puzzleId)
+{
+  std::scoped_lock<std::mutex> lock(subscriberMutex_);
+
+  if (subscriber->puzzleId_ == puzzleId)
+    return;
+
+  unsubscribeFromPuzzle(*subscriber);
+
+  if (puzzleId == -1)
+    return;
+
+  auto puzzleSubscribers = std::make_shared<PuzzleSubscribers>(*puzzleSubscribers_);
+  auto &topic = (*puzzleSubscribers)[puzzleId];
+  auto subscribers = topic ? std::make_shared<SubscriberList>(*topic) : std::make_shared<SubscriberList>();
+  subscribers->push_back(subscriber);
+  topic = std::move(subscribers);
+
+  subscriber->puzzleId_ = puzzleId;
+  std::atomic_store(&puzzleSubscribers_, std::shared_ptr<const PuzzleSubscribers>(std::move(puzzleSubscribers)));
+}
+
+void Dispatcher::unsubscribeFromPuzzle(Subscriber &subscriber)
+{
+  const auto topic = puzzleSubscribers_->find(subscriber.puzzleId_);
+  subscriber.puzzleId_ = -1;
+
+  if (topic == end(*puzzleSubscribers_))
+    return;
+
+  auto subscribers = std::make_shared<SubscriberList>(*topic->second);
+  auto it = std::find_if(begin(*subscribers), end(*subscribers), [&subscriber](auto &s) {
+    return s.get() == &subscriber;
+  });
+  if (it != end(*subscribers))
+    subscribers->erase(it);
+
+  // only the lists of this puzzle are copied, the others are shared
+  auto puzzleSubscribers = std::make_shared<PuzzleSubscribers>(*puzzleSubscribers_);
+  if (subscribers->empty())
+    puzzleSubscribers->erase(topic->first);
+  else
+    (*puzzleSubscribers)[topic->first] = std::move(subscribers);
+
+  std::atomic_store(&puzzleSubscribers_, std::shared_ptr<const PuzzleSubscribers>(std::move(puzzleSubscribers)));
+}
+
+std::shared_ptr<const Dispatcher::SubscriberList> Dispatcher::puzzleSubscribers(long long puzzleId) const
+{
+  const auto puzzleSubscribers = std::atomic_load(&puzzleSubscribers_);
+
+  const auto topic = puzzleSubscribers->find(puzzleId);
+  if (topic == end(*puzzleSubscribers))
+    return nullptr;
+
+  return topic->second;
 }
 
 void Dispatcher::notifyUserAdded(Subscriber &self,
@@ -36,14 +139,13 @@ void Dispatcher::notifyUserAdded(Subscriber &self,
                                  const Wt::WString &name,
                                  const Wt::WColor &color)
 {
-  std::scoped_lock<std::mutex> lock(subscriberMutex_);
+  const auto subscribers = std::atomic_load(&subscribers_);
+  const auto event = std::make_shared<const Event>(UserAddedEvent{id, name, color});
 
-  for (auto subscriber : subscribers_) {
-    if (&self == &subscriber.get())
+  for (const auto &subscriber : *subscribers) {
+    if (&self == subscriber.get())
       continue;
-    server_->post(subscriber.get().sessionId(), [subscriber, id, name, color]{
-      subscriber.get().userAdded().emit(id, name, color);
-    });
+    deliver(subscriber, event);
   }
 }
 
@@ -51,30 +153,25 @@ void Dispatcher::notifyUserChangedColor(Subscriber &self,
                                         long long id,
                                         const Wt::WColor &color)
 {
-  std::scoped_lock<std::mutex> lock(subscriberMutex_);
+  const auto subscribers = std::atomic_load(&subscribers_);
+  const auto event = std::make_shared<const Event>(UserChangedColorEvent{id, color});
 
-  for (auto subscriber : subscribers_) {
-    if (&self == &subscriber.get())
+  for (const auto &subscriber : *subscribers) {
+    if (&self == subscriber.get())
       continue;
-    server_->post(subscriber.get().sessionId(), [subscriber, id, color]{
-      subscriber.get().userChangedColor().emit(id, color);
-    });
+    deliver(subscriber, event);
   }
 }
 
 void Dispatcher::notifyCellValueChanged(Subscriber &self,
                                         long long puzzleId,
-                                        std::pair<int, int> cellRef)
+                                        std::pair<int, int> cellRef,
+                                        const CellValue &value)
 {
-  std::scoped_lock<std::mutex> lock(subscriberMutex_);
+  broadcast(self.sessionId(), puzzleId, std::make_shared<const Event>(CellValueChangedEvent{puzzleId, cellRef, value}));
 
-  for (auto subscriber : subscribers_) {
-    if (&self == &subscriber.get())
-      continue;
-    server_->post(subscriber.get().sessionId(), [subscriber, puzzleId, cellRef]{
-      subscriber.get().cellValueChanged().emit(puzzleId, cellRef);
-    });
-  }
+  if (replicator_)
+    replicator_->publishCellValueChanged(puzzleId, cellRef);
 }
 
 void Dispatcher::notifyCursorMoved(Subscriber &self,
@@ -83,51 +180,260 @@ void Dispatcher::notifyCursorMoved(Subscriber &self,
                                    std::pair<int, int> cellRef,
                                    Wt::Orientation direction)
 {
-  {
-    std::scoped_lock<std::mutex> lock(positionMutex_);
+  queueCursorMoved(self.sessionId(), puzzleId, user, cellRef, direction);
+}
+
+void Dispatcher::notifyCellEdited(Subscriber &self,
+                                  long long puzzleId,
+                                  std::pair<int, int> cellRef,
+                                  const CellValue &value,
+                                  long long user,
+                                  std::pair<int, int> cursorCellRef,
+                                  Wt::Orientation direction)
+{
+  // the presence store is updated first, the viewers paint the cursor from it
+  queueCursorMoved(self.sessionId(), puzzleId, user, cursorCellRef, direction, true);
+
+  broadcast(self.sessionId(), puzzleId, std::make_shared<const Event>(CellEditedEvent{{puzzleId, cellRef, value},
+                                                                           {puzzleId, user, cursorCellRef, direction}}));
+
+  if (replicator_)
+    replicator_->publishCellValueChanged(puzzleId, cellRef);
+}
+
+void Dispatcher::remoteCellValueChanged(long long puzzleId,
+                                        std::pair<int, int> cellRef,
+                                        const CellValue &value)
+{
+  broadcast(std::string(), puzzleId, std::make_shared<const Event>(CellValueChangedEvent{puzzleId, cellRef, value}));
+}
+
+void Dispatcher::remoteCursorMoved(long long puzzleId,
+                                   long long user,
+                                   std::pair<int, int> cellRef,
+                                   Wt::Orientation direction)
+{
+  queueCursorMoved(std::string(), puzzleId, user, cellRef, direction);
+}
+
+void Dispatcher::broadcast(const std::string &selfSessionId,
+                           long long puzzleId,
+                           const std::shared_ptr<const Event> &event)
+{
+  const auto subscribers = puzzleSubscribers(puzzleId);
+  if (!subscribers)
+    return;
+
+  for (const auto &subscriber : *subscribers) {
+    if (subscriber->sessionId() == selfSessionId)
+      continue;
+    deliver(subscriber, event);
+  }
+}
+
+void Dispatcher::queueCursorMoved(const std::string &selfSessionId,
+                                  long long puzzleId,
+                                  long long user,
+                                  std::pair<int, int> cellRef,
+                                  Wt::Orientation direction,
+                                  bool withEdit)
+{
+  std::scoped_lock<std::mutex> lock(cursorMutex_);
+
+  // the puzzle the cursor was on before, its viewers need to see it go
+  const auto previousPuzzleId = presence_.move(user, userRegistry_.indexOf(user), puzzleId, cellRef, direction);
+
+  if (!previousPuzzleId)
+    return;
+
+  // Only the latest move of every user is sent. The presence store is
+  // already up to date, so a repaint in the meantime shows it anyway.
+  auto pending = std::find_if(begin(pendingCursorMoves_), end(pendingCursorMoves_), [user](const PendingCursorMove &move) {
+    return user == move.user;
+  });
+
+  if (pending == end(pendingCursorMoves_)) {
+    pending = pendingCursorMoves_.emplace(end(pendingCursorMoves_));
+    pending->selfSessionId = selfSessionId;
+    pending->local = !selfSessionId.empty();
+    pending->user = user;
+  } else if (pending->selfSessionId != selfSessionId) {
+    pending->selfSessionId.clear(); // moved from several sessions, tell all of them
+    pending->local = pending->local || !selfSessionId.empty();
+  }
+
+  pending->puzzleId = puzzleId;
+  pending->cellRef = cellRef;
+  pending->direction = direction;
+  for (const long long topicId : { puzzleId, previousPuzzleId.value() }) {
+    if (topicId != -1 &&
+        std::find(begin(pending->topicIds), end(pending->topicIds), topicId) == end(pending->topicIds))
+      pending->topicIds.push_back(topicId);
+  }
+  if (withEdit) {
+    pending->topicIds.erase(std::remove(begin(pending->topicIds), end(pending->topicIds), puzzleId),
+                            end(pending->topicIds));
+  }
 
-    auto it = std::find_if(begin(userPositions_), end(userPositions_), [user](const UserCursor &cursor) {
-      return user == cursor.userId;
+  if (!cursorFlushScheduled_) {
+    cursorFlushScheduled_ = true;
+    cursorTimer_.expires_after(cursorCoalesceInterval);
+    cursorTimer_.async_wait([this](boost::system::error_code errc) {
+      if (!errc)
+        flushCursorMoves();
     });
+  }
+}
 
-    if (puzzleId == -1 ||
-         cellRef == std::pair(-1, -1)) {
-      if (it != end(userPositions_)) {
-        userPositions_.erase(it);
-      } else {
-        return;
-      }
-    } else if (it != end(userPositions_)) {
-      it->puzzleId = puzzleId;
-      it->cellRef = cellRef;
-      it->direction = direction;
-    } else {
-      userPositions_.push_back({puzzleId, user, cellRef, direction});
+void Dispatcher::flushCursorMoves()
+{
+  std::vector<PendingCursorMove> moves;
+  {
+    std::scoped_lock<std::mutex> lock(cursorMutex_);
+    moves.swap(pendingCursorMoves_);
+    cursorFlushScheduled_ = false;
+  }
+
+  for (const PendingCursorMove &move : moves) {
+    const auto event = std::make_shared<const Event>(CursorMovedEvent{move.puzzleId, move.user, move.cellRef, move.direction});
+
+    for (const long long topicId : move.topicIds) {
+      broadcast(move.selfSessionId, topicId, event);
     }
   }
 
-  {
-    std::scoped_lock<std::mutex> lock(subscriberMutex_);
-
-    for (auto subscriber : subscribers_) {
-      if (&self == &subscriber.get())
-        continue;
-      server_->post(subscriber.get().sessionId(), [subscriber, puzzleId, user, cellRef, direction]{
-        subscriber.get().cursorMoved().emit(puzzleId, user, cellRef, direction);
-      });
+  if (replicator_) {
+    for (const PendingCursorMove &move : moves) {
+      if (move.local)
+        replicator_->publishCursorMoved(move.puzzleId, move.user, move.cellRef, move.direction);
     }
   }
 }
 
-std::vector<UserCursor> Dispatcher::userPositions() const
+void Dispatcher::deliver(const std::shared_ptr<Subscriber> &subscriber, const std::shared_ptr<const Event> &event)
 {
-  std::scoped_lock<std::mutex> lock(positionMutex_);
+  // the subscriber may have been removed in the meantime, it is kept alive
+  // until the post has run, or was dropped because the session is gone
+  bool overflowed = false;
+  if (subscriber->push(event, inboxCapacity_, overflowed)) {
+    server_->post(subscriber->sessionId(), [subscriber]{
+      subscriber->drain();
+    });
+  }
 
-  return userPositions_;
+  if (overflowed) {
+    ++overflows_;
+    Wt::log("warning") << "Dispatcher" << ": session " << subscriber->sessionId() << " fell behind, it will resync";
+  }
 }
 
 Subscriber::Subscriber(const std::string &sessionId)
   : sessionId_(sessionId)
 { }
 
+bool Subscriber::push(const std::shared_ptr<const Event> &event,
+                      std::size_t capacity,
+                      bool &overflowed)
+{
+  std::scoped_lock<std::mutex> lock(inboxMutex_);
+
+  overflowed = false;
+
+  if (resyncPending_)
+    return false; // everything is reloaded anyway
+
+  if (const auto *move = std::get_if<CursorMovedEvent>(event.get())) {
+    auto &lane = inbox_[CursorLane];
+    auto it = std::find_if(begin(lane), end(lane), [move](const auto &queued) {
+      return std::get<CursorMovedEvent>(*queued).user == move->user;
+    });
+    if (it != end(lane)) {
+      *it = event; // the inbox isn't empty, so a drain is already posted
+      return false;
+    }
+  }
+
+  // a drain is only posted for the first event in an empty inbox
+  const bool wasEmpty = inboxSize_ == 0;
+
+  if (const auto *edit = std::get_if<CellEditedEvent>(event.get())) {
+    // The edit carries a newer position of the cursor, and the cell lane is
+    // drained first, so a queued move of the same user would be shown after it.
+    auto &lane = inbox_[CursorLane];
+    auto it = std::find_if(begin(lane), end(lane), [edit](const auto &queued) {
+      return std::get<CursorMovedEvent>(*queued).user == edit->cursor.user;
+    });
+    if (it != end(lane)) {
+      lane.erase(it);
+      --inboxSize_;
+    }
+  }
+
+  if (inboxSize_ >= capacity) {
+    // the inbox isn't empty, so a drain is already posted
+    for (auto &lane : inbox_) {
+      lane.clear();
+    }
+    inbox_[CellLane].push_back(std::make_shared<const Event>(ResyncEvent{}));
+    inboxSize_ = 1;
+    resyncPending_ = true;
+    overflowed = true;
+    return false;
+  }
+
+  Lane lane = CellLane;
+  if (std::holds_alternative<CursorMovedEvent>(*event)) {
+    lane = CursorLane;
+  } else if (std::holds_alternative<UserAddedEvent>(*event) ||
+             std::holds_alternative<UserChangedColorEvent>(*event)) {
+    lane = UserLane;
+  }
+
+  inbox_[lane].push_back(event);
+  ++inboxSize_;
+  return wasEmpty;
+}
+
+std::size_t Subscriber::inboxSize() const
+{
+  std::scoped_lock<std::mutex> lock(inboxMutex_);
+
+  return inboxSize_;
+}
+
+void Subscriber::drain()
+{
+  std::array<std::vector<std::shared_ptr<const Event>>, LaneCount> lanes;
+  {
+    std::scoped_lock<std::mutex> lock(inboxMutex_);
+    lanes.swap(inbox_);
+    inboxSize_ = 0;
+    resyncPending_ = false;
+  }
+
+  bool empty = true;
+  for (const auto &lane : lanes) {
+    for (const auto &event : lane) {
+      empty = false;
+      if (const auto *e = std::get_if<UserAddedEvent>(event.get())) {
+        userAdded_.emit(e->id, e->name, e->color);
+      } else if (const auto *e = std::get_if<UserChangedColorEvent>(event.get())) {
+        userChangedColor_.emit(e->id, e->color);
+      } else if (const auto *e = std::get_if<CellValueChangedEvent>(event.get())) {
+        cellValueChanged_.emit(e->puzzleId, e->cellRef, e->value);
+      } else if (const auto *e = std::get_if<CursorMovedEvent>(event.get())) {
+        cursorMoved_.emit(e->puzzleId, e->user, e->cellRef, e->direction);
+      } else if (const auto *e = std::get_if<CellEditedEvent>(event.get())) {
+        cellValueChanged_.emit(e->cell.puzzleId, e->cell.cellRef, e->cell.value);
+        cursorMoved_.emit(e->cursor.puzzleId, e->cursor.user, e->cursor.cellRef, e->cursor.direction);
+      } else if (std::holds_alternative<ResyncEvent>(*event)) {
+        resync_.emit();
+      }
+    }
+  }
+
+  if (!empty)
+    Wt::WApplication::instance()->triggerUpdate();
+}
+
 }
@@ -6,34 +6,101 @@
 
 #include <Wt/WSignal.h>
 
+#include "CellStates.h"
+#include "PresenceStore.h"
+#include "UserRegistry.h"
+
 #include "model/Puzzle.h"
 
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <variant>
 #include <vector>
 
 #include <Wt/WColor.h>
 
 namespace swedish {
 
+class Replicator;
 class Subscriber;
 
-struct UserCursor {
-  long long puzzleId = -1;
-  long long userId = -1;
-  std::pair<int, int> cellRef = {-1, -1};
-  Wt::Orientation direction = Wt::Orientation::Horizontal;
+struct UserAddedEvent {
+  long long id;
+  Wt::WString name;
+  Wt::WColor color;
+};
+
+struct UserChangedColorEvent {
+  long long id;
+  Wt::WColor color;
+};
+
+struct CellValueChangedEvent {
+  long long puzzleId;
+  std::pair<int, int> cellRef;
+  CellValue value;
+};
+
+struct CursorMovedEvent {
+  long long puzzleId;
+  long long user;
+  std::pair<int, int> cellRef;
+  Wt::Orientation direction;
+};
+
+// a cell edit together with the cursor move that came with it
+struct CellEditedEvent {
+  CellValueChangedEvent cell;
+  CursorMovedEvent cursor;
+};
+
+// replaces the events of a session that fell behind, it should reload everything
+struct ResyncEvent { };
+
+// one event is shared by all subscribers it is sent to
+using Event = std::variant<UserAddedEvent, UserChangedColorEvent, CellValueChangedEvent, CursorMovedEvent, CellEditedEvent, ResyncEvent>;
+
+struct DispatcherStats {
+  std::size_t subscribers = 0;
+  std::size_t queuedEvents = 0; // in all inboxes together
+  std::size_t maxQueuedEvents = 0; // in the fullest inbox
+  std::uint64_t overflows = 0; // since startup
 };
 
 // one dispatcher in the entire program, to send events
 class Dispatcher final {
 public:
-  Dispatcher(Wt::WServer *server);
+  Dispatcher(Wt::WServer *server,
+             UserRegistry &userRegistry);
+
+  // when set, local cell and cursor changes are also sent to other processes
+  void setReplicator(Replicator *replicator) { replicator_ = replicator; }
 
-  void addSubsriber(Subscriber &subscriber);
+  // The most events that may wait in the inbox of one session. When a session
+  // falls further behind, its events are replaced by one ResyncEvent.
+  void setInboxCapacity(std::size_t capacity) { inboxCapacity_ = std::max<std::size_t>(capacity, 1); }
+
+  DispatcherStats stats() const;
+
+  void addSubsriber(const std::shared_ptr<Subscriber> &subscriber);
   void removeSubscriber(Subscriber &subscriber);
 
+  // Cell and cursor events of a puzzle only go to the subscribers viewing it,
+  // -1 if the subscriber is not viewing any puzzle. This doesn't need
+  // addSubsriber() to be called first.
+  void subscribeToPuzzle(const std::shared_ptr<Subscriber> &subscriber, long long puzzleId);
+
   void notifyUserAdded(Subscriber &self,
                        long long id,
                        const Wt::WString &name,
@@ -43,9 +110,11 @@ public:
                               long long id,
                               const Wt::WColor &color);
 
+  // the value is sent along, so viewers don't need to look it up
   void notifyCellValueChanged(Subscriber &self,
                               long long puzzleId,
-                              std::pair<int, int> cellRef);
+                              std::pair<int, int> cellRef,
+                              const CellValue &value);
 
   void notifyCursorMoved(Subscriber &self,
                          long long puzzleId,
@@ -53,14 +122,92 @@ public:
                          std::pair<int, int> cellRef,
                          Wt::Orientation direction);
 
-  std::vector<UserCursor> userPositions() const;
+  // a cell edit that also moved the cursor of the user, the viewers get
+  // both in one event
+  void notifyCellEdited(Subscriber &self,
+                        long long puzzleId,
+                        std::pair<int, int> cellRef,
+                        const CellValue &value,
+                        long long user,
+                        std::pair<int, int> cursorCellRef,
+                        Wt::Orientation direction);
+
+  // changes that were made by another process, see Replicator
+  void remoteCellValueChanged(long long puzzleId,
+                              std::pair<int, int> cellRef,
+                              const CellValue &value);
+
+  void remoteCursorMoved(long long puzzleId,
+                         long long user,
+                         std::pair<int, int> cellRef,
+                         Wt::Orientation direction);
+
+  // the cursors on the puzzle, nullptr if there never were any
+  std::shared_ptr<const PresenceSnapshot> presence(long long puzzleId) const { return presence_.snapshot(puzzleId); }
 
 private:
+  using SubscriberList = std::vector<std::shared_ptr<Subscriber>>;
+  using PuzzleSubscribers = std::unordered_map<long long, std::shared_ptr<const SubscriberList>>;
+
+  // The subscribers are published as immutable lists that are swapped
+  // atomically, so notifying iterates over them without locking. Adding and
+  // removing subscribers copies the list and swaps it, under subscriberMutex_.
   std::mutex subscriberMutex_;
-  mutable std::mutex positionMutex_;
+  std::mutex cursorMutex_;
   Wt::WServer *server_;
-  std::vector<std::reference_wrapper<Subscriber>> subscribers_;
-  std::vector<UserCursor> userPositions_;
+  UserRegistry &userRegistry_;
+  Replicator *replicator_ = nullptr;
+  std::atomic<std::size_t> inboxCapacity_;
+  std::atomic<std::uint64_t> overflows_;
+  std::shared_ptr<const SubscriberList> subscribers_; // use std::atomic_load/std::atomic_store
+  std::shared_ptr<const PuzzleSubscribers> puzzleSubscribers_; // use std::atomic_load/std::atomic_store
+  PresenceStore presence_;
+
+  struct PendingCursorMove {
+    std::string selfSessionId; // not notified, empty if none
+    bool local = false; // whether to send it to other processes
+    long long user = -1;
+    long long puzzleId = -1;
+    std::pair<int, int> cellRef = {-1, -1};
+    Wt::Orientation direction = Wt::Orientation::Horizontal;
+    std::vector<long long> topicIds; // puzzles whose viewers are notified
+  };
+
+  // protected by cursorMutex_
+  std::vector<PendingCursorMove> pendingCursorMoves_;
+  bool cursorFlushScheduled_ = false;
+  boost::asio::steady_timer cursorTimer_;
+
+  // NOTE: NEED subscriberMutex_ BEFORE CALLING THIS
+  void unsubscribeFromPuzzle(Subscriber &subscriber);
+
+  // the viewers of the puzzle, nullptr if there are none
+  std::shared_ptr<const SubscriberList> puzzleSubscribers(long long puzzleId) const;
+
+  // Queues the event in the inbox of the subscriber. Only the first event
+  // in an empty inbox posts to the session, which then handles all events
+  // that arrived in the meantime at once. See also setInboxCapacity().
+  void deliver(const std::shared_ptr<Subscriber> &subscriber, const std::shared_ptr<const Event> &event);
+
+  // Sends the event to the viewers of the puzzle. selfSessionId is the session
+  // that made the change, empty if it came from another process.
+  void broadcast(const std::string &selfSessionId,
+                 long long puzzleId,
+                 const std::shared_ptr<const Event> &event);
+
+  // Updates the position of the user right away, but sends the move to the
+  // viewers and other processes a little later, together with other moves.
+  // A later move of the same user replaces one that wasn't sent yet.
+  // If withEdit is set, the viewers of puzzleId already got the move along
+  // with a cell edit, it is then only sent to other processes.
+  void queueCursorMoved(const std::string &selfSessionId,
+                        long long puzzleId,
+                        long long user,
+                        std::pair<int, int> cellRef,
+                        Wt::Orientation direction,
+                        bool withEdit = false);
+
+  void flushCursorMoves();
 };
 
 // one subsciber per WApplication, to receive events
@@ -72,15 +219,49 @@ public:
 
   Wt::Signal<long long, const Wt::WString &, const Wt::WColor &> &userAdded() { return userAdded_; }
   Wt::Signal<long long, const Wt::WColor &> &userChangedColor() { return userChangedColor_; }
-  Wt::Signal<long long, std::pair<int, int>> &cellValueChanged() { return cellValueChanged_; }
+  Wt::Signal<long long, std::pair<int, int>, CellValue> &cellValueChanged() { return cellValueChanged_; }
   Wt::Signal<long long, long long, std::pair<int, int>, Wt::Orientation> &cursorMoved() { return cursorMoved_; }
+  Wt::Signal<> &resync() { return resync_; }
 
 private:
+  friend class Dispatcher;
+
   std::string sessionId_;
+  long long puzzleId_ = -1; // see Dispatcher::subscribeToPuzzle, protected by its subscriberMutex_
+
+  // The inbox has a lane per priority, drained in this order: cell edits
+  // (and resyncs) first, then cursor moves, then changes to the users.
+  // A queued cursor move is replaced by a later move of the same user.
+  enum Lane {
+    CellLane,
+    CursorLane,
+    UserLane,
+    LaneCount
+  };
+
+  // protected by inboxMutex_
+  mutable std::mutex inboxMutex_;
+  std::array<std::vector<std::shared_ptr<const Event>>, LaneCount> inbox_;
+  std::size_t inboxSize_ = 0; // in all lanes together
+  bool resyncPending_ = false; // the inbox only holds a ResyncEvent
+
+  // Queues the event, returns true if the inbox was empty. When the inbox
+  // is full, its events are replaced by one ResyncEvent and overflowed is set.
+  bool push(const std::shared_ptr<const Event> &event,
+            std::size_t capacity,
+            bool &overflowed);
+
+  std::size_t inboxSize() const;
+
+  // emits the signals for all events in the inbox, then triggers one update,
+  // must be called from within the session
+  void drain();
+
   Wt::Signal<long long, const Wt::WString &, const Wt::WColor &> userAdded_;
   Wt::Signal<long long, const Wt::WColor &> userChangedColor_;
-  Wt::Signal<long long, std::pair<int, int>> cellValueChanged_;
+  Wt::Signal<long long, std::pair<int, int>, CellValue> cellValueChanged_;
   Wt::Signal<long long, long long, std::pair<int, int>, Wt::Orientation> cursorMoved_;
+  Wt::Signal<> resync_;
 };
 
 }
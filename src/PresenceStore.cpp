@@ -0,0 +1,100 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "PresenceStore.h"
+
+#include <algorithm>
+
+namespace swedish {
+
+PresenceSnapshot::Range PresenceSnapshot::at(std::pair<int, int> cellRef) const
+{
+  const auto first = std::lower_bound(begin(cursors), end(cursors), cellRef, [](const UserCursor &cursor, std::pair<int, int> cellRef) {
+    return cursor.cellRef < cellRef;
+  });
+  const auto last = std::upper_bound(first, end(cursors), cellRef, [](std::pair<int, int> cellRef, const UserCursor &cursor) {
+    return cellRef < cursor.cellRef;
+  });
+
+  return Range(cursors.data() + (first - begin(cursors)),
+               cursors.data() + (last - begin(cursors)));
+}
+
+std::optional<long long> PresenceStore::move(long long user,
+                                             UserRegistry::Index userIndex,
+                                             long long puzzleId,
+                                             std::pair<int, int> cellRef,
+                                             Wt::Orientation direction)
+{
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  const auto it = userPuzzles_.find(user);
+  const long long previousPuzzleId = it == end(userPuzzles_) ? -1 : it->second;
+
+  if (puzzleId == -1 ||
+      cellRef == std::pair(-1, -1)) {
+    if (previousPuzzleId == -1)
+      return std::nullopt;
+
+    remove(user, previousPuzzleId);
+    return previousPuzzleId;
+  }
+
+  if (previousPuzzleId != puzzleId)
+    remove(user, previousPuzzleId);
+
+  userPuzzles_[user] = puzzleId;
+
+  PuzzlePresence &presence = puzzles_[puzzleId];
+  presence.cursors[user] = {puzzleId, user, userIndex, cellRef, direction};
+  ++presence.version;
+  presence.snapshot = nullptr;
+
+  return previousPuzzleId;
+}
+
+std::shared_ptr<const PresenceSnapshot> PresenceStore::snapshot(long long puzzleId) const
+{
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  const auto it = puzzles_.find(puzzleId);
+  if (it == end(puzzles_))
+    return nullptr;
+
+  const PuzzlePresence &presence = it->second;
+
+  if (!presence.snapshot) {
+    auto snapshot = std::make_shared<PresenceSnapshot>();
+    snapshot->version = presence.version;
+    snapshot->cursors.reserve(presence.cursors.size());
+    for (const auto &cursor : presence.cursors) {
+      snapshot->cursors.push_back(cursor.second);
+    }
+    std::stable_sort(begin(snapshot->cursors), end(snapshot->cursors), [](const UserCursor &lhs, const UserCursor &rhs) {
+      return lhs.cellRef < rhs.cellRef;
+    });
+    presence.snapshot = std::move(snapshot);
+  }
+
+  return presence.snapshot;
+}
+
+void PresenceStore::remove(long long user, long long puzzleId)
+{
+  userPuzzles_.erase(user);
+
+  const auto it = puzzles_.find(puzzleId);
+  if (it == end(puzzles_))
+    return;
+
+  // the puzzle is kept when it has no cursors left, so its version keeps increasing
+  PuzzlePresence &presence = it->second;
+  if (presence.cursors.erase(user) == 0)
+    return;
+
+  ++presence.version;
+  presence.snapshot = nullptr;
+}
+
+}
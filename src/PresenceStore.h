@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include "UserRegistry.h"
+
+#include <Wt/WGlobal.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace swedish {
+
+struct UserCursor {
+  long long puzzleId = -1;
+  long long userId = -1;
+  UserRegistry::Index userIndex = UserRegistry::noUser;
+  std::pair<int, int> cellRef = {-1, -1};
+  Wt::Orientation direction = Wt::Orientation::Horizontal;
+};
+
+// An immutable copy of the cursors on one puzzle, taken at one version.
+// The cursors are sorted by cell, row major, so the cursors on a cell
+// are found with a binary search.
+struct PresenceSnapshot final {
+  class Range final {
+  public:
+    Range(const UserCursor *begin, const UserCursor *end)
+      : begin_(begin), end_(end)
+    { }
+
+    const UserCursor *begin() const { return begin_; }
+    const UserCursor *end() const { return end_; }
+    bool empty() const { return begin_ == end_; }
+
+  private:
+    const UserCursor *begin_;
+    const UserCursor *end_;
+  };
+
+  std::uint64_t version = 0;
+  std::vector<UserCursor> cursors;
+
+  // the cursors on the given cell
+  Range at(std::pair<int, int> cellRef) const;
+};
+
+// The cursor of every user, indexed by puzzle and by user. Every puzzle
+// has a version that is incremented when a cursor on it changes, its
+// snapshot is only rebuilt after that.
+class PresenceStore final {
+public:
+  // Moves the cursor of the user, puzzleId -1 or cellRef (-1, -1) removes it.
+  // Returns the puzzle the cursor was on before, -1 if it had none,
+  // or nullopt if there was no cursor to remove.
+  std::optional<long long> move(long long user,
+                                UserRegistry::Index userIndex,
+                                long long puzzleId,
+                                std::pair<int, int> cellRef,
+                                Wt::Orientation direction);
+
+  // the cursors on the puzzle, nullptr if there never were any
+  std::shared_ptr<const PresenceSnapshot> snapshot(long long puzzleId) const;
+
+private:
+  struct PuzzlePresence {
+    std::uint64_t version = 0;
+    std::unordered_map<long long, UserCursor> cursors; // by user
+    mutable std::shared_ptr<const PresenceSnapshot> snapshot; // nullptr when outdated
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<long long, long long> userPuzzles_; // user to puzzle
+  std::unordered_map<long long, PuzzlePresence> puzzles_;
+
+  // NOTE: NEED LOCK BEFORE CALLING THIS
+  void remove(long long user, long long puzzleId);
+};
+
+}
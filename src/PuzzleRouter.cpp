@@ -0,0 +1,72 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "PuzzleRouter.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+// points on the ring per worker, to spread puzzles evenly
+constexpr const int virtualNodes = 128;
+
+// FNV-1a followed by the splitmix64 finalizer, stable across builds and hosts
+std::uint64_t hash(const std::string &str)
+{
+  std::uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char c : str) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+}
+
+namespace swedish {
+
+PuzzleRouter::PuzzleRouter(const std::vector<std::string> &workers,
+                           const std::string &self)
+  : workers_(workers),
+    self_(self)
+{
+  assert(!workers_.empty());
+
+  for (std::size_t i = 0; i < workers_.size(); ++i) {
+    for (int v = 0; v < virtualNodes; ++v) {
+      ring_.emplace_back(hash(workers_[i] + "#" + std::to_string(v)), i);
+    }
+  }
+
+  std::sort(begin(ring_), end(ring_));
+}
+
+bool PuzzleRouter::isLocal(long long puzzleId) const
+{
+  return owner(puzzleId) == self_;
+}
+
+const std::string &PuzzleRouter::owner(long long puzzleId) const
+{
+  const std::uint64_t h = hash(std::to_string(puzzleId));
+
+  auto it = std::lower_bound(begin(ring_), end(ring_), std::make_pair(h, std::size_t(0)));
+  if (it == end(ring_))
+    it = begin(ring_);
+
+  return workers_[it->second];
+}
+
+std::string PuzzleRouter::url(long long puzzleId) const
+{
+  return owner(puzzleId) + "/" + std::to_string(puzzleId);
+}
+
+}
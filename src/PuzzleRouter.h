@@ -0,0 +1,41 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace swedish {
+
+// Decides which worker process owns a puzzle, when puzzles are sharded
+// over multiple processes instead of replicated (see Replicator).
+//
+// Workers are identified by the URL they're reachable on, e.g. the path
+// prefix a reverse proxy routes to them. Puzzles are assigned to workers
+// with consistent hashing, so adding or removing a worker only moves the
+// puzzles of that worker.
+class PuzzleRouter final {
+public:
+  PuzzleRouter(const std::vector<std::string> &workers,
+               const std::string &self);
+
+  // whether the given puzzle is owned by this process
+  bool isLocal(long long puzzleId) const;
+
+  // the URL of the worker that owns the given puzzle
+  const std::string &owner(long long puzzleId) const;
+
+  // the URL of the given puzzle on the worker that owns it
+  std::string url(long long puzzleId) const;
+
+private:
+  std::vector<std::string> workers_;
+  std::string self_;
+  std::vector<std::pair<std::uint64_t, std::size_t>> ring_; // (hash, worker index), sorted
+};
+
+}
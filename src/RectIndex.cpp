@@ -0,0 +1,90 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "RectIndex.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace swedish {
+
+RectIndex::RectIndex(double bucketSize)
+  : bucketSize_(std::max(bucketSize, 1.0))
+{ }
+
+void RectIndex::insert(const Wt::WRectF &rect, int value)
+{
+  if (rect.isNull())
+    return;
+
+  const std::int32_t left = bucketCoordinate(rect.left());
+  const std::int32_t right = bucketCoordinate(rect.right());
+  const std::int32_t top = bucketCoordinate(rect.top());
+  const std::int32_t bottom = bucketCoordinate(rect.bottom());
+
+  for (std::int32_t y = top; y <= bottom; ++y) {
+    for (std::int32_t x = left; x <= right; ++x) {
+      buckets_[key(x, y)].push_back({rect, value});
+    }
+  }
+}
+
+bool RectIndex::contains(const Wt::WPointF &point) const
+{
+  const std::vector<Entry> *entries = bucket(point);
+
+  if (!entries)
+    return false;
+
+  return std::any_of(begin(*entries), end(*entries), [&point](const Entry &entry) {
+    return entry.rect.contains(point);
+  });
+}
+
+int RectIndex::closest(const Wt::WPointF &point) const
+{
+  const std::vector<Entry> *entries = bucket(point);
+
+  if (!entries)
+    return -1;
+
+  int result = -1;
+  double smallestDistance = -1;
+  for (const Entry &entry : *entries) {
+    if (entry.rect.contains(point)) {
+      const Wt::WPointF center = entry.rect.center();
+      const double distance = std::hypot(point.x() - center.x(), point.y() - center.y());
+      if (result == -1 ||
+          distance < smallestDistance) {
+        result = entry.value;
+        smallestDistance = distance;
+      }
+    }
+  }
+
+  return result;
+}
+
+std::int32_t RectIndex::bucketCoordinate(double v) const
+{
+  return static_cast<std::int32_t>(std::floor(v / bucketSize_));
+}
+
+std::uint64_t RectIndex::key(std::int32_t x, std::int32_t y)
+{
+  return (static_cast<std::uint64_t>(static_cast<std::uint32_t>(x)) << 32) |
+         static_cast<std::uint32_t>(y);
+}
+
+const std::vector<RectIndex::Entry> *RectIndex::bucket(const Wt::WPointF &point) const
+{
+  const auto it = buckets_.find(key(bucketCoordinate(point.x()), bucketCoordinate(point.y())));
+
+  if (it == end(buckets_))
+    return nullptr;
+
+  return &it->second;
+}
+
+}
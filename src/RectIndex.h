@@ -0,0 +1,50 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include <Wt/WPointF.h>
+#include <Wt/WRectF.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace swedish {
+
+// A uniform grid of buckets over a set of rectangles, to find the rectangles
+// containing a point without checking all of them. Every rectangle is added
+// to all buckets it overlaps, so a lookup only checks one bucket.
+//
+// The bucket size should be about the size of the rectangles.
+class RectIndex final {
+public:
+  explicit RectIndex(double bucketSize = 1.0);
+
+  bool empty() const { return buckets_.empty(); }
+
+  void insert(const Wt::WRectF &rect, int value);
+
+  // whether any rectangle contains the point
+  bool contains(const Wt::WPointF &point) const;
+
+  // the value of the rectangle containing the point whose center is closest
+  // to it, the one inserted first if there's a tie, -1 if there is none
+  int closest(const Wt::WPointF &point) const;
+
+private:
+  struct Entry {
+    Wt::WRectF rect;
+    int value;
+  };
+
+  double bucketSize_;
+  std::unordered_map<std::uint64_t, std::vector<Entry>> buckets_;
+
+  std::int32_t bucketCoordinate(double v) const;
+  static std::uint64_t key(std::int32_t x, std::int32_t y);
+  const std::vector<Entry> *bucket(const Wt::WPointF &point) const;
+};
+
+}
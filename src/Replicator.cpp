@@ -0,0 +1,371 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "Replicator.h"
+
+#include "Dispatcher.h"
+#include "SharedSession.h"
+
+#include <Wt/WLogger.h>
+
+#include <libpq-fe.h>
+
+#include <poll.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <exception>
+#include <iterator>
+#include <locale>
+#include <random>
+#include <sstream>
+
+using namespace std::chrono_literals;
+
+namespace {
+
+constexpr const std::chrono::seconds reconnectInterval = 5s;
+constexpr const int pollTimeoutMs = 500;
+
+std::uint64_t randomOrigin()
+{
+  std::random_device rd;
+  std::mt19937_64 gen((static_cast<std::uint64_t>(rd()) << 32) ^
+                      static_cast<std::uint64_t>(rd()) ^
+                      static_cast<std::uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+  return gen();
+}
+
+// PQescapeLiteral or PQescapeIdentifier, empty on failure
+template<typename Escape>
+std::string escape(PGconn *conn, const std::string &str, Escape escapeFunction)
+{
+  char *escaped = escapeFunction(conn, str.c_str(), str.size());
+  if (!escaped)
+    return std::string();
+
+  std::string result(escaped);
+  PQfreemem(escaped);
+  return result;
+}
+
+}
+
+namespace swedish {
+
+Replicator::Replicator(const std::string &connectionString,
+                       const std::string &channel,
+                       SharedSession &sharedSession,
+                       Dispatcher &dispatcher)
+  : connectionString_(connectionString),
+    channel_(channel),
+    sharedSession_(sharedSession),
+    dispatcher_(dispatcher),
+    origin_(randomOrigin()),
+    cursorSequence_(0),
+    stopped_(true)
+{
+  if (channel_.empty()) {
+    Wt::log("error") << "swedish::Replicator" << ": empty channel name, using 'swedish'";
+    channel_ = "swedish";
+  }
+}
+
+Replicator::~Replicator()
+{
+  stop();
+}
+
+void Replicator::start()
+{
+  if (!stopped_)
+    return;
+
+  Wt::log("info") << "swedish::Replicator" << ": replicating on channel '" << channel_ << "' as origin " << origin_;
+
+  stopped_ = false;
+  listenThread_ = std::thread(&Replicator::listen, this);
+  publishThread_ = std::thread(&Replicator::publish, this);
+}
+
+void Replicator::stop()
+{
+  {
+    std::scoped_lock<std::mutex> lock(queueMutex_);
+    if (stopped_)
+      return;
+    stopped_ = true;
+  }
+  queueCondition_.notify_all();
+
+  if (listenThread_.joinable())
+    listenThread_.join();
+  if (publishThread_.joinable())
+    publishThread_.join();
+}
+
+void Replicator::publishCellValueChanged(long long puzzleId,
+                                         std::pair<int, int> cellRef)
+{
+  std::uint64_t tick = 0;
+  std::pair<Character, long long> value;
+  {
+    std::scoped_lock<std::mutex> lock(clockMutex_);
+
+    PuzzleClock &clock = clocks_[puzzleId];
+    tick = ++clock.tick;
+    clock.cells[cellRef] = { tick, origin_ };
+    value = sharedSession_.charAt(puzzleId, cellRef);
+  }
+
+  std::ostringstream ss;
+  ss.imbue(std::locale::classic());
+  ss << "c " << origin_ << ' ' << puzzleId << ' ' << tick << ' '
+     << cellRef.first << ' ' << cellRef.second << ' '
+     << static_cast<int>(value.first) << ' ' << value.second;
+  enqueue(ss.str());
+}
+
+void Replicator::publishCursorMoved(long long puzzleId,
+                                    long long user,
+                                    std::pair<int, int> cellRef,
+                                    Wt::Orientation direction)
+{
+  std::ostringstream ss;
+  ss.imbue(std::locale::classic());
+  ss << "m " << origin_ << ' ' << ++cursorSequence_ << ' ' << puzzleId << ' ' << user << ' '
+     << cellRef.first << ' ' << cellRef.second << ' '
+     << (direction == Wt::Orientation::Horizontal ? 'h' : 'v');
+  enqueue(ss.str());
+}
+
+void Replicator::enqueue(std::string payload)
+{
+  {
+    std::scoped_lock<std::mutex> lock(queueMutex_);
+    if (stopped_)
+      return;
+    queue_.push_back(std::move(payload));
+  }
+  queueCondition_.notify_one();
+}
+
+void Replicator::listen()
+{
+  while (!stopped_) {
+    PGconn *conn = connect(true);
+
+    if (!conn) {
+      const auto retry = std::chrono::steady_clock::now() + reconnectInterval;
+      while (!stopped_ && std::chrono::steady_clock::now() < retry) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(pollTimeoutMs));
+      }
+      continue;
+    }
+
+    while (!stopped_ &&
+           PQstatus(conn) == CONNECTION_OK) {
+      pollfd fd{};
+      fd.fd = PQsocket(conn);
+      fd.events = POLLIN;
+      const int result = poll(&fd, 1, pollTimeoutMs);
+      if (result < 0 && errno != EINTR) {
+        Wt::log("error") << "swedish::Replicator" << ": poll failed";
+        break;
+      }
+      if (result <= 0)
+        continue;
+
+      if (!PQconsumeInput(conn)) {
+        Wt::log("error") << "swedish::Replicator" << ": lost connection: " << PQerrorMessage(conn);
+        break;
+      }
+
+      while (PGnotify *notify = PQnotifies(conn)) {
+        // a bad notification, or a database error while handling it, shouldn't stop the listener
+        try {
+          handleNotification(notify->extra);
+        } catch (const std::exception &e) {
+          Wt::log("error") << "swedish::Replicator" << ": could not handle notification '" << notify->extra << "': " << e.what();
+        }
+        PQfreemem(notify);
+      }
+    }
+
+    PQfinish(conn);
+  }
+}
+
+void Replicator::publish()
+{
+  PGconn *conn = nullptr;
+  std::vector<std::string> batch; // kept until it is sent
+
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(queueMutex_);
+      const bool retry = !batch.empty();
+      if (retry) {
+        queueCondition_.wait_for(lock, reconnectInterval, [this]{ return stopped_.load(); });
+      } else {
+        queueCondition_.wait(lock, [this]{ return stopped_ || !queue_.empty(); });
+      }
+      if (batch.empty() && queue_.empty())
+        break; // stopped
+      if (retry && stopped_) {
+        Wt::log("error") << "swedish::Replicator" << ": stopping, dropping " << batch.size() + queue_.size() << " notifications";
+        break;
+      }
+      batch.insert(end(batch), std::make_move_iterator(begin(queue_)), std::make_move_iterator(end(queue_)));
+      queue_.clear();
+    }
+
+    if (!conn)
+      conn = connect(false);
+
+    if (conn) {
+      // payloads only contain digits, letters, spaces and '-', so they need no escaping
+      const std::string channel = escape(conn, channel_, PQescapeLiteral);
+      std::string sql = "SELECT ";
+      for (std::size_t i = 0; i < batch.size(); ++i) {
+        if (i != 0)
+          sql += ", ";
+        sql += "pg_notify(" + channel + ", '" + batch[i] + "')";
+      }
+
+      PGresult *result = PQexec(conn, sql.c_str());
+      if (PQresultStatus(result) == PGRES_TUPLES_OK) {
+        batch.clear();
+      } else {
+        Wt::log("error") << "swedish::Replicator" << ": notify failed: " << PQerrorMessage(conn);
+        PQfinish(conn);
+        conn = nullptr;
+      }
+      PQclear(result);
+    }
+
+    if (!batch.empty()) {
+      // Other processes would keep the old values of these cells, and overwrite
+      // ours when they sync, so the edits are retried. Cursor moves are outdated
+      // by then anyway.
+      batch.erase(std::remove_if(begin(batch), end(batch), [](const std::string &payload) {
+        return payload[0] == 'm';
+      }), end(batch));
+      if (!batch.empty())
+        Wt::log("error") << "swedish::Replicator" << ": could not notify, retrying " << batch.size() << " notifications";
+    }
+  }
+
+  if (conn)
+    PQfinish(conn);
+}
+
+void Replicator::handleNotification(const std::string &payload)
+{
+  std::istringstream ss(payload);
+  ss.imbue(std::locale::classic());
+
+  char type = 0;
+  std::uint64_t origin = 0;
+  ss >> type >> origin;
+  if (!ss || origin == origin_)
+    return;
+
+  if (type == 'c') {
+    long long puzzleId = -1;
+    std::uint64_t tick = 0;
+    std::pair<int, int> cellRef;
+    int character = 0;
+    long long user = -1;
+    ss >> puzzleId >> tick >> cellRef.first >> cellRef.second >> character >> user;
+    if (!ss ||
+        character < static_cast<int>(Character::None) ||
+        character > static_cast<int>(Character::IJ) ||
+        cellRef.first < 0 ||
+        cellRef.second < 0)
+      return;
+
+    // the cells of a puzzle that isn't cached are checked when it is loaded
+    if (sharedSession_.isCached(puzzleId) &&
+        !sharedSession_.isCachedCell(puzzleId, cellRef))
+      return;
+
+    bool applied = false;
+    {
+      std::scoped_lock<std::mutex> lock(clockMutex_);
+
+      PuzzleClock &clock = clocks_[puzzleId];
+      clock.tick = std::max(clock.tick, tick);
+
+      Stamp &cellStamp = clock.cells[cellRef];
+      const Stamp stamp{ tick, origin };
+      if (stamp <= cellStamp)
+        return; // we already have a newer value
+      cellStamp = stamp;
+
+      applied = sharedSession_.applyRemoteEdit(puzzleId,
+                                               {cellRef, static_cast<Character>(character), user, std::nullopt, std::nullopt});
+    }
+
+    if (applied) {
+      dispatcher_.remoteCellValueChanged(puzzleId, cellRef, sharedSession_.valueAt(puzzleId, cellRef));
+    }
+  } else if (type == 'm') {
+    std::uint64_t sequence = 0;
+    long long puzzleId = -1;
+    long long user = -1;
+    std::pair<int, int> cellRef;
+    char direction = 0;
+    ss >> sequence >> puzzleId >> user >> cellRef.first >> cellRef.second >> direction;
+    if (!ss)
+      return;
+
+    // (-1, -1) removes the cursor, other cells are only known for cached puzzles
+    if (cellRef != std::make_pair(-1, -1) &&
+        !sharedSession_.isCachedCell(puzzleId, cellRef))
+      return;
+
+    {
+      std::scoped_lock<std::mutex> lock(clockMutex_);
+
+      std::uint64_t &lastSequence = lastCursorSequences_[origin];
+      if (sequence <= lastSequence)
+        return;
+      lastSequence = sequence;
+    }
+
+    dispatcher_.remoteCursorMoved(puzzleId,
+                                  user,
+                                  cellRef,
+                                  direction == 'v' ? Wt::Orientation::Vertical : Wt::Orientation::Horizontal);
+  }
+}
+
+PGconn *Replicator::connect(bool listen)
+{
+  PGconn *conn = PQconnectdb(connectionString_.c_str());
+
+  if (PQstatus(conn) != CONNECTION_OK) {
+    Wt::log("error") << "swedish::Replicator" << ": could not connect: " << PQerrorMessage(conn);
+    PQfinish(conn);
+    return nullptr;
+  }
+
+  if (listen) {
+    const std::string sql = "LISTEN " + escape(conn, channel_, PQescapeIdentifier);
+    PGresult *result = PQexec(conn, sql.c_str());
+    const bool ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    PQclear(result);
+    if (!ok) {
+      Wt::log("error") << "swedish::Replicator" << ": LISTEN failed: " << PQerrorMessage(conn);
+      PQfinish(conn);
+      return nullptr;
+    }
+  }
+
+  return conn;
+}
+
+}
@@ -0,0 +1,92 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include "model/Puzzle.h"
+
+#include <Wt/WGlobal.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+typedef struct pg_conn PGconn;
+
+namespace swedish {
+
+class Dispatcher;
+class SharedSession;
+
+// Replicates cell edits and cursor moves between multiple processes that use the
+// same database, using Postgres' LISTEN/NOTIFY.
+//
+// Every puzzle has a Lamport clock: local edits are stamped with the next tick,
+// and remote stamps advance the clock. Every cell remembers the (tick, origin)
+// of its last edit, and a remote edit only applies if its stamp is newer, so all
+// processes converge on the same value when two of them edit a cell at once.
+class Replicator final {
+public:
+  Replicator(const std::string &connectionString,
+             const std::string &channel,
+             SharedSession &sharedSession,
+             Dispatcher &dispatcher);
+  ~Replicator();
+
+  Replicator(const Replicator &) = delete;
+  Replicator &operator=(const Replicator &) = delete;
+
+  void start();
+  void stop();
+
+  void publishCellValueChanged(long long puzzleId,
+                               std::pair<int, int> cellRef);
+
+  void publishCursorMoved(long long puzzleId,
+                          long long user,
+                          std::pair<int, int> cellRef,
+                          Wt::Orientation direction);
+
+private:
+  using Stamp = std::pair<std::uint64_t, std::uint64_t>; // (tick, origin)
+
+  struct PuzzleClock {
+    std::uint64_t tick = 0;
+    std::map<std::pair<int, int>, Stamp> cells;
+  };
+
+  std::string connectionString_;
+  std::string channel_;
+  SharedSession &sharedSession_;
+  Dispatcher &dispatcher_;
+  std::uint64_t origin_;
+
+  std::mutex clockMutex_;
+  std::unordered_map<long long, PuzzleClock> clocks_;
+  std::atomic<std::uint64_t> cursorSequence_;
+  std::unordered_map<std::uint64_t, std::uint64_t> lastCursorSequences_; // by origin
+
+  std::mutex queueMutex_;
+  std::condition_variable queueCondition_;
+  std::vector<std::string> queue_;
+
+  std::atomic_bool stopped_;
+  std::thread listenThread_;
+  std::thread publishThread_;
+
+  void enqueue(std::string payload);
+  void listen();
+  void publish();
+  void handleNotification(const std::string &payload);
+  PGconn *connect(bool listen);
+};
+
+}
@@ -6,26 +6,22 @@
 
 #include <Wt/WLogger.h>
 
+#include <Wt/Dbo/Exception.h>
 #include <Wt/Dbo/Transaction.h>
 
 #include <algorithm>
 #include <chrono>
+#include <exception>
 #include <thread>
 
-using namespace std::chrono_literals;
-
-namespace {
-
-constexpr const std::chrono::seconds interval = 3s;
-
-}
-
 namespace swedish {
 
 SharedSession::SharedSession(Wt::WIOService *ioService,
-                             std::unique_ptr<Wt::Dbo::SqlConnection> conn)
+                             std::unique_ptr<Wt::Dbo::SqlConnection> conn,
+                             UserRegistry &userRegistry)
   : ioService_(ioService),
-    session_(std::move(conn)),
+    session_(std::move(conn), userRegistry),
+    userRegistry_(userRegistry),
     terminated_(false)
 {
   try {
@@ -35,6 +31,15 @@ SharedSession::SharedSession(Wt::WIOService *ioService,
     Wt::log("info") << "swedish::SharedSession" << ": Assuming tables already exist and continuing";
   }
 
+  try {
+    // for databases created before puzzles were stored in binary
+    Wt::Dbo::Transaction t(session_);
+    session_.execute("alter table \"puzzles\" add column if not exists \"binary_data\" bytea");
+    session_.execute("alter table \"puzzles\" add column if not exists \"state\" bytea");
+  } catch (Wt::Dbo::Exception &e) {
+    Wt::log("error") << "swedish::SharedSession" << ": Could not add binary columns: " << e.what();
+  }
+
   session_.setFlushMode(Wt::Dbo::FlushMode::Manual);
 }
 
@@ -53,35 +58,82 @@ SharedSession::~SharedSession()
   }
 }
 
+void SharedSession::setSyncSettings(const SyncSettings &settings)
+{
+  std::scoped_lock<std::mutex> lock(mutex_);
+  syncSettings_ = settings;
+}
+
 void SharedSession::startTimer()
 {
+  std::scoped_lock<std::mutex> lock(mutex_);
+
   timer_ = std::make_unique<boost::asio::steady_timer>(*ioService_);
-  timer_->expires_after(interval);
-  timer_->async_wait(std::bind(&SharedSession::timeout, shared_from_this(), std::placeholders::_1));
+
+  // the timer is only armed while there are unsynced changes
+  if (dirtyCells_ > 0) {
+    scheduleSync(Clock::now());
+  }
 }
 
 void SharedSession::stopTimer()
 {
+  std::scoped_lock<std::mutex> lock(mutex_);
+
   timer_->cancel();
   timer_ = nullptr;
 }
 
-std::pair<Character, long long> SharedSession::charAt(long long puzzle,
-                                                      std::pair<int, int> cellRef) const
+std::shared_ptr<const PuzzleGeometry> SharedSession::geometry(long long puzzle) const
 {
   if (terminated_)
-    return { Character::None, -1 };
+    return nullptr;
 
   std::scoped_lock<std::mutex> lock(mutex_);
 
-  Wt::Dbo::ptr<Puzzle> puzzlePtr = getPuzzle(puzzle);
+  const CachedPuzzle *cached = getPuzzle(puzzle);
+
+  if (!cached)
+    return nullptr;
+
+  return cached->geometry;
+}
+
+std::shared_ptr<const CellStates> SharedSession::cellStates(long long puzzle) const
+{
+  if (terminated_)
+    return nullptr;
+
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  const CachedPuzzle *cached = getPuzzle(puzzle);
+
+  if (!cached)
+    return nullptr;
+
+  return cached->states;
+}
+
+std::pair<Character, long long> SharedSession::charAt(long long puzzle,
+                                                      std::pair<int, int> cellRef) const
+{
+  const auto states = cellStates(puzzle);
 
-  if (!puzzlePtr)
+  if (!states)
     return { Character::None, -1 }; // TODO(Roel): error!
 
-  const Cell &cell = puzzlePtr->rows_[static_cast<std::size_t>(cellRef.first)][static_cast<std::size_t>(cellRef.second)];
+  return states->charAt(cellRef);
+}
+
+CellValue SharedSession::valueAt(long long puzzle,
+                                std::pair<int, int> cellRef) const
+{
+  const auto states = cellStates(puzzle);
 
-  return { cell.character_, cell.user_ };
+  if (!states)
+    return {};
+
+  return states->valueAt(cellRef);
 }
 
 std::optional<std::pair<Character, long long>> SharedSession::updateChar(long long puzzle,
@@ -94,69 +146,345 @@ std::optional<std::pair<Character, long long>> SharedSession::updateChar(long lo
 
   std::scoped_lock<std::mutex> lock(mutex_);
 
-  Wt::Dbo::ptr<Puzzle> puzzlePtr = getPuzzle(puzzle);
+  CachedPuzzle *cached = getPuzzle(puzzle);
 
-  if (!puzzlePtr)
+  if (!cached)
     return std::nullopt;
 
-  Cell &cell = puzzlePtr.modify()->rows_[static_cast<std::size_t>(cellRef.first)][static_cast<std::size_t>(cellRef.second)];
+  return applyEdit(*cached, {cellRef, character, user, std::nullopt, std::nullopt});
+}
+
+std::vector<std::optional<std::pair<Character, long long>>> SharedSession::applyEdits(long long puzzle,
+                                                                                      const std::vector<CellEdit> &edits)
+{
+  std::vector<std::optional<std::pair<Character, long long>>> results(edits.size());
+
+  if (terminated_)
+    return results;
+
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  CachedPuzzle *cached = getPuzzle(puzzle);
+
+  if (!cached)
+    return results;
+
+  for (std::size_t i = 0; i < edits.size(); ++i) {
+    results[i] = applyEdit(*cached, edits[i]);
+  }
+
+  return results;
+}
+
+bool SharedSession::applyRemoteEdit(long long puzzle,
+                                    const CellEdit &edit)
+{
+  if (terminated_)
+    return false;
+
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  CachedPuzzle *cached = findPuzzle(puzzle);
+
+  if (!cached) {
+    // only the latest edit of a cell matters, the Replicator orders them
+    std::vector<CellEdit> &edits = remoteEdits_[puzzle];
+    auto it = std::find_if(begin(edits), end(edits), [&edit](const CellEdit &e) {
+      return e.cellRef == edit.cellRef;
+    });
+    if (it == end(edits)) {
+      edits.push_back(edit);
+    } else {
+      *it = edit;
+    }
+    return false;
+  }
+
+  if (!hasCell(*cached, edit.cellRef))
+    return false;
+
+  return applyEdit(*cached, edit).has_value();
+}
+
+bool SharedSession::isCached(long long puzzle) const
+{
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  return findPuzzle(puzzle) != nullptr;
+}
+
+bool SharedSession::isCachedCell(long long puzzle,
+                                 std::pair<int, int> cellRef) const
+{
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  const CachedPuzzle *cached = findPuzzle(puzzle);
+
+  return cached && hasCell(*cached, cellRef);
+}
 
-  if (cell.character_ == character) {
+bool SharedSession::hasCell(const CachedPuzzle &cached,
+                            std::pair<int, int> cellRef)
+{
+  return cellRef.first >= 0 && cellRef.first < cached.geometry->rowCount() &&
+         cellRef.second >= 0 && cellRef.second < cached.geometry->colCount();
+}
+
+void SharedSession::applyRemoteEdits(CachedPuzzle &cached) const
+{
+  auto it = remoteEdits_.find(cached.id);
+  if (it == end(remoteEdits_))
+    return;
+
+  // Not marked dirty: the process that made the edit writes it. They only need
+  // to be in our cell states, so our next sync doesn't overwrite them.
+  for (const CellEdit &edit : it->second) {
+    if (hasCell(cached, edit.cellRef)) {
+      cached.states->store(edit.cellRef, edit.character, edit.user);
+    }
+  }
+
+  remoteEdits_.erase(it);
+}
+
+std::optional<std::pair<Character, long long>> SharedSession::applyEdit(CachedPuzzle &cached,
+                                                                        const CellEdit &edit)
+{
+  const auto retval = cached.states->charAt(edit.cellRef);
+
+  if ((edit.ifCharacter && retval.first != edit.ifCharacter.value()) ||
+      (edit.ifUser && retval.second != edit.ifUser.value())) {
+    return std::nullopt;
+  }
+
+  if (!cached.states->store(edit.cellRef, edit.character, edit.user)) {
     return std::nullopt;
   }
 
-  const auto retval = std::make_pair(cell.character_, cell.user_);
-  cell.character_ = character;
-  cell.user_ = user;
+  if (cached.dirtyCells.empty()) {
+    cached.dirtyCells.resize(static_cast<std::size_t>(cached.geometry->rowCount() * cached.geometry->colCount()));
+  }
+  auto dirty = cached.dirtyCells[static_cast<std::size_t>(edit.cellRef.first * cached.geometry->colCount() + edit.cellRef.second)];
+  changed(!dirty);
+  dirty = true;
   return std::optional(retval);
 }
 
-Wt::Dbo::ptr<Puzzle> SharedSession::getPuzzle(long long puzzle) const
+void SharedSession::prewarm(Wt::Dbo::SqlConnectionPool &pool,
+                            int puzzleCount,
+                            int connectionCount,
+                            const std::function<bool(long long)> &include)
 {
-  auto it = std::find_if(begin(puzzles_), end(puzzles_), [puzzle](const Wt::Dbo::ptr<Puzzle> &puzzlePtr) {
-    return puzzle == puzzlePtr.id();
-  });
+  if (puzzleCount <= 0)
+    return;
 
-  if (it == end(puzzles_)) {
+  std::vector<long long> ids;
+  {
+    Session session(pool, userRegistry_);
+    Wt::Dbo::Transaction t(session);
+
+    // Filtered before limiting, so every worker loads puzzleCount puzzles that
+    // it owns. Without a filter, the database does the limiting (-1: no limit).
+    Wt::Dbo::collection<long long> result = session.query<long long>("select id from puzzles")
+        .orderBy("id desc")
+        .limit(include ? -1 : puzzleCount);
+    for (const long long id : result) {
+      if (include && !include(id))
+        continue;
+      ids.push_back(id);
+      if (ids.size() >= static_cast<std::size_t>(puzzleCount))
+        break;
+    }
+  }
+
+  Wt::log("info") << "SharedSession" << ": prewarming " << ids.size() << " puzzles";
+
+  // every thread loads every connectionCount'th puzzle with its own session,
+  // so the loading and decoding happens in parallel
+  std::vector<std::thread> threads;
+  const std::size_t threadCount = std::min(ids.size(), static_cast<std::size_t>(std::max(connectionCount, 1)));
+  for (std::size_t i = 0; i < threadCount; ++i) {
+    threads.emplace_back([this, &pool, &ids, i, threadCount]{
+      Session session(pool, userRegistry_);
+
+      for (std::size_t j = i; j < ids.size(); j += threadCount) {
+        try {
+          Wt::Dbo::Transaction t(session);
+
+          Wt::Dbo::ptr<Puzzle> puzzlePtr = session.load<Puzzle>(ids[j]);
+          if (puzzlePtr->needsMigration()) {
+            puzzlePtr.modify(); // written back in binary format on commit
+          }
+          auto geometry = std::make_shared<const PuzzleGeometry>(*puzzlePtr);
+          auto states = std::make_shared<CellStates>(*puzzlePtr, userRegistry_);
+
+          std::scoped_lock<std::mutex> lock(mutex_);
+          if (!findPuzzle(ids[j])) {
+            applyRemoteEdits(puzzles_.emplace_back(CachedPuzzle{ids[j], std::move(geometry), std::move(states), {}}));
+          }
+        } catch (const Wt::Dbo::Exception &e) {
+          Wt::log("error") << "SharedSession" << ": could not prewarm puzzle " << ids[j] << ": " << e.what();
+        }
+      }
+    });
+  }
+
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+SharedSession::CachedPuzzle *SharedSession::getPuzzle(long long puzzle) const
+{
+  CachedPuzzle *cached = findPuzzle(puzzle);
+
+  if (!cached) {
     Wt::Dbo::Transaction t(session_);
 
     Wt::Dbo::ptr<Puzzle> puzzlePtr = session_.load<Puzzle>(puzzle);
 
-    if (puzzlePtr) {
-      puzzles_.push_back(puzzlePtr);
+    if (!puzzlePtr) {
+      return nullptr;
     }
 
-    return puzzlePtr;
+    if (puzzlePtr->needsMigration()) {
+      puzzlePtr.modify(); // written back in binary format on commit
+    }
+
+    auto geometry = std::make_shared<const PuzzleGeometry>(*puzzlePtr);
+    auto states = std::make_shared<CellStates>(*puzzlePtr, userRegistry_);
+    CachedPuzzle &cached = puzzles_.emplace_back(CachedPuzzle{puzzle, std::move(geometry), std::move(states), {}});
+    applyRemoteEdits(cached);
+    return &cached;
   } else {
-    return *it;
+    return cached;
   }
 }
 
+SharedSession::CachedPuzzle *SharedSession::findPuzzle(long long puzzle) const
+{
+  auto it = std::find_if(begin(puzzles_), end(puzzles_), [puzzle](const CachedPuzzle &cached) {
+    return puzzle == cached.id;
+  });
+
+  if (it == end(puzzles_))
+    return nullptr;
+
+  return &*it;
+}
+
+void SharedSession::changed(bool newDirtyCell)
+{
+  const auto now = Clock::now();
+
+  lastChange_ = now;
+
+  // changing a cell again doesn't bring the sync closer
+  if (!newDirtyCell)
+    return;
+
+  ++dirtyCells_;
+
+  if (dirtyCells_ == 1) {
+    firstChange_ = now;
+    scheduleSync(now + syncSettings_.interval);
+  } else if (dirtyCells_ >= syncSettings_.dirtyCells &&
+             !flushRequested_) {
+    flushRequested_ = true;
+    scheduleSync(now);
+  }
+}
+
+void SharedSession::scheduleSync(Clock::time_point time)
+{
+  if (!timer_)
+    return;
+
+  // this cancels the pending wait, if any
+  timer_->expires_at(time);
+  timer_->async_wait(std::bind(&SharedSession::timeout, shared_from_this(), std::placeholders::_1));
+}
+
 void SharedSession::timeout(boost::system::error_code errc)
 {
   if (errc || terminated_)
     return;
 
-  sync(false);
+  {
+    std::scoped_lock<std::mutex> lock(mutex_);
 
-  if (!terminated_) {
-    timer_->expires_after(interval);
-    timer_->async_wait(std::bind(&SharedSession::timeout, shared_from_this(), std::placeholders::_1));
+    if (dirtyCells_ == 0)
+      return;
+
+    // Keep postponing while changes keep coming in, to coalesce them,
+    // up to the maximum age or the maximum number of changes.
+    if (!flushRequested_) {
+      const auto due = std::min(lastChange_ + syncSettings_.interval,
+                                firstChange_ + syncSettings_.maxAge);
+      if (due > Clock::now()) {
+        scheduleSync(due);
+        return;
+      }
+    }
   }
+
+  sync(false);
 }
 
 void SharedSession::sync(bool last)
 {
-  Wt::log("info") << "SharedSession" << ": performing global sync";
-
   std::scoped_lock<std::mutex> lock(mutex_);
 
   if (terminated_ && !last)
     return;
 
+  if (dirtyCells_ == 0)
+    return;
+
+  Wt::log("info") << "SharedSession" << ": syncing " << dirtyCells_ << " changed cells";
+
+  std::vector<CachedPuzzle *> dirty;
+  for (CachedPuzzle &cached : puzzles_) {
+    if (!cached.dirtyCells.empty()) {
+      dirty.push_back(&cached);
+    }
+  }
+
+  try {
+    flush(dirty);
+  } catch (const std::exception &e) {
+    // the puzzles stay dirty, so nothing is lost if the database comes back
+    Wt::log("error") << "SharedSession" << ": could not sync, retrying later: " << e.what();
+    if (!last) {
+      scheduleSync(Clock::now() + syncSettings_.interval);
+    }
+    return;
+  }
+
+  // only cleared once committed, edits can't come in in the meantime because of the lock
+  dirtyCells_ = 0;
+  flushRequested_ = false;
+  for (CachedPuzzle *cached : dirty) {
+    cached->dirtyCells.clear();
+  }
+}
+
+void SharedSession::flush(const std::vector<CachedPuzzle *> &puzzles)
+{
   Wt::Dbo::Transaction t(session_);
 
-  session_.flush();
+  // Only the state column is written, the geometry never changes. This doesn't
+  // go through Dbo, so it doesn't conflict with other processes writing the
+  // same puzzle (see Replicator): their edits are already in our cell states.
+  for (CachedPuzzle *cached : puzzles) {
+    const auto snapshot = cached->states->snapshot();
+    session_.execute("update \"puzzles\" set \"state\" = ? where \"id\" = ?")
+        .bind(encodeState(snapshot->values()))
+        .bind(cached->id);
+  }
+
+  // committed here rather than in the destructor, so a failure can be caught
+  t.commit();
 }
 
 }
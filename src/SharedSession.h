@@ -4,7 +4,11 @@
 
 #pragma once
 
+#include "CellStates.h"
+#include "UserRegistry.h"
+
 #include "model/Puzzle.h"
+#include "model/PuzzleGeometry.h"
 #include "model/Session.h"
 
 #include <Wt/WIOService.h>
@@ -13,27 +17,76 @@
 #include <boost/system/error_code.hpp>
 
 #include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 namespace swedish {
 
+// When to write changed cells to the database
+struct SyncSettings {
+  // sync when there were no changes for this long...
+  std::chrono::milliseconds interval = std::chrono::seconds(3);
+  // ...but never later than this after the first unsynced change
+  std::chrono::milliseconds maxAge = std::chrono::seconds(10);
+  // sync right away once this many cells have unsynced changes
+  int dirtyCells = 200;
+};
+
+// A change to one cell, optionally conditional on its current value
+struct CellEdit {
+  std::pair<int, int> cellRef;
+  Character character = Character::None;
+  long long user = -1;
+  // only applied if the cell currently holds this character...
+  std::optional<Character> ifCharacter;
+  // ...and it was entered by this user
+  std::optional<long long> ifUser;
+};
+
 class SharedSession final : public std::enable_shared_from_this<SharedSession> {
 public:
   SharedSession(Wt::WIOService *ioService,
-                std::unique_ptr<Wt::Dbo::SqlConnection> conn);
+                std::unique_ptr<Wt::Dbo::SqlConnection> conn,
+                UserRegistry &userRegistry);
 
   ~SharedSession();
 
+  void setSyncSettings(const SyncSettings &settings);
+
+  // the user indices used by the cell states and snapshots
+  UserRegistry &userRegistry() const { return userRegistry_; }
+
   void startTimer();
   void stopTimer();
 
+  // Loads the given number of most recent puzzles into the cache, spread over
+  // the given number of connections from the pool. Blocks until done.
+  // If include is set, only puzzles for which it returns true are counted and loaded.
+  void prewarm(Wt::Dbo::SqlConnectionPool &pool,
+               int puzzleCount,
+               int connectionCount,
+               const std::function<bool(long long)> &include = nullptr);
+
+  // returns the immutable geometry of the given puzzle, nullptr if it doesn't exist
+  std::shared_ptr<const PuzzleGeometry> geometry(long long puzzle) const;
+
+  // returns the lock free cell states of the given puzzle, nullptr if it doesn't exist
+  std::shared_ptr<const CellStates> cellStates(long long puzzle) const;
+
   // returns (character, userid)
   std::pair<Character, long long> charAt(long long puzzle,
                                          std::pair<int, int> cellRef) const;
 
+  // returns the character, user index and version of the cell
+  CellValue valueAt(long long puzzle,
+                    std::pair<int, int> cellRef) const;
+
   // returns the old value (character, userid),
   // optional since maybe this does nothing
   std::optional<std::pair<Character, long long>> updateChar(long long puzzle,
@@ -41,18 +94,70 @@ public:
                                                             Character character,
                                                             long long user);
 
+  // Applies all edits atomically, in order. For every edit, returns the old
+  // value (character, userid) if it was applied, or nullopt if the condition
+  // didn't hold or the character was unchanged.
+  std::vector<std::optional<std::pair<Character, long long>>> applyEdits(long long puzzle,
+                                                                         const std::vector<CellEdit> &edits);
+
+  // Applies an edit made by another process, see Replicator. Unlike applyEdits(),
+  // this never loads the puzzle: if it isn't cached yet, the edit is kept and
+  // applied when it is, since the other process may not have written it to the
+  // database yet. Returns whether the cell changed.
+  bool applyRemoteEdit(long long puzzle,
+                       const CellEdit &edit);
+
+  bool isCached(long long puzzle) const;
+
+  // whether the puzzle is cached and has a cell at the given position
+  bool isCachedCell(long long puzzle,
+                    std::pair<int, int> cellRef) const;
+
 private:
+  struct CachedPuzzle {
+    long long id = -1;
+    std::shared_ptr<const PuzzleGeometry> geometry;
+    std::shared_ptr<CellStates> states;
+    std::vector<bool> dirtyCells; // by row major index, empty if none
+  };
+
+  using Clock = boost::asio::steady_timer::clock_type;
+
   Wt::WIOService *ioService_;
   std::unique_ptr<boost::asio::steady_timer> timer_;
+  SyncSettings syncSettings_;
+  int dirtyCells_ = 0; // distinct cells
+  Clock::time_point firstChange_;
+  Clock::time_point lastChange_;
+  bool flushRequested_ = false;
   mutable Session session_;
   mutable std::mutex mutex_;
-  mutable std::vector<Wt::Dbo::ptr<Puzzle>> puzzles_;
+  UserRegistry &userRegistry_;
+  mutable std::vector<CachedPuzzle> puzzles_;
+  // the latest remote edit of every cell of puzzles that aren't cached yet
+  mutable std::unordered_map<long long, std::vector<CellEdit>> remoteEdits_;
   std::atomic_bool terminated_;
 
   // NOTE: NEED LOCK BEFORE CALLING THIS
-  Wt::Dbo::ptr<Puzzle> getPuzzle(long long puzzle) const;
+  CachedPuzzle *getPuzzle(long long puzzle) const;
+  // NOTE: NEED LOCK BEFORE CALLING THIS
+  CachedPuzzle *findPuzzle(long long puzzle) const;
+  static bool hasCell(const CachedPuzzle &cached,
+                      std::pair<int, int> cellRef);
+  // applies the remote edits kept for a puzzle that was just loaded
+  // NOTE: NEED LOCK BEFORE CALLING THIS
+  void applyRemoteEdits(CachedPuzzle &cached) const;
+  // NOTE: NEED LOCK BEFORE CALLING THIS
+  std::optional<std::pair<Character, long long>> applyEdit(CachedPuzzle &cached,
+                                                           const CellEdit &edit);
+  // NOTE: NEED LOCK BEFORE CALLING THIS
+  void changed(bool newDirtyCell);
+  // NOTE: NEED LOCK BEFORE CALLING THIS
+  void scheduleSync(Clock::time_point time);
   void timeout(boost::system::error_code errc);
   void sync(bool last);
+  // NOTE: NEED LOCK BEFORE CALLING THIS
+  void flush(const std::vector<CachedPuzzle *> &puzzles);
 };
 
 }
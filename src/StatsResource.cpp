@@ -0,0 +1,35 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "StatsResource.h"
+
+#include "Dispatcher.h"
+
+#include <Wt/Http/Request.h>
+#include <Wt/Http/Response.h>
+
+namespace swedish {
+
+StatsResource::StatsResource(const Dispatcher &dispatcher)
+  : dispatcher_(dispatcher)
+{ }
+
+StatsResource::~StatsResource()
+{
+  beingDeleted();
+}
+
+void StatsResource::handleRequest([[maybe_unused]] const Wt::Http::Request &request,
+                                  Wt::Http::Response &response)
+{
+  const DispatcherStats stats = dispatcher_.stats();
+
+  response.setMimeType("text/plain");
+  response.out() << "subscribers " << stats.subscribers << '\n'
+                 << "queued_events " << stats.queuedEvents << '\n'
+                 << "max_queued_events " << stats.maxQueuedEvents << '\n'
+                 << "overflows " << stats.overflows << '\n';
+}
+
+}
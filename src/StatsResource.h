@@ -0,0 +1,27 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include <Wt/WResource.h>
+
+namespace swedish {
+
+class Dispatcher;
+
+// Shows the DispatcherStats as plain text, one "name value" pair per line
+class StatsResource final : public Wt::WResource {
+public:
+  explicit StatsResource(const Dispatcher &dispatcher);
+  ~StatsResource() override;
+
+protected:
+  void handleRequest(const Wt::Http::Request &request,
+                     Wt::Http::Response &response) override;
+
+private:
+  const Dispatcher &dispatcher_;
+};
+
+}
@@ -0,0 +1,52 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "UserRegistry.h"
+
+#include <Wt/WLogger.h>
+
+namespace swedish {
+
+UserRegistry::UserRegistry()
+  : ids_(std::make_unique<std::atomic<long long>[]>(capacity)),
+    size_(1)
+{
+  ids_[noUser].store(-1, std::memory_order_relaxed);
+}
+
+UserRegistry::~UserRegistry() = default;
+
+UserRegistry::Index UserRegistry::indexOf(long long userId)
+{
+  if (userId == -1)
+    return noUser;
+
+  std::scoped_lock<std::mutex> lock(mutex_);
+
+  auto it = indices_.find(userId);
+  if (it != end(indices_))
+    return it->second;
+
+  const std::size_t size = size_.load(std::memory_order_relaxed);
+  if (size == capacity) {
+    Wt::log("error") << "swedish::UserRegistry" << ": out of user indices, dropping user " << userId;
+    return noUser;
+  }
+
+  const auto index = static_cast<Index>(size);
+  ids_[index].store(userId, std::memory_order_relaxed);
+  size_.store(size + 1, std::memory_order_release);
+  indices_.emplace(userId, index);
+  return index;
+}
+
+long long UserRegistry::userId(Index index) const
+{
+  if (index >= size_.load(std::memory_order_acquire))
+    return -1;
+
+  return ids_[index].load(std::memory_order_relaxed);
+}
+
+}
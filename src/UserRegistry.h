@@ -0,0 +1,45 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace swedish {
+
+// Assigns dense 16 bit indices to user ids, so a user fits in a packed cell word.
+// Index 0 is reserved for "no user" (id -1). Indices are never reused, so looking
+// up the id of an index is lock free.
+class UserRegistry final {
+public:
+  using Index = std::uint16_t;
+
+  static constexpr Index noUser = 0;
+
+  UserRegistry();
+  ~UserRegistry();
+
+  UserRegistry(const UserRegistry &) = delete;
+  UserRegistry &operator=(const UserRegistry &) = delete;
+
+  // returns the index for the given user id, assigning a new one if needed
+  Index indexOf(long long userId);
+
+  // returns the user id for the given index, -1 if unknown
+  long long userId(Index index) const;
+
+private:
+  static constexpr std::size_t capacity = 1 << 16;
+
+  std::mutex mutex_;
+  std::unordered_map<long long, Index> indices_;
+  std::unique_ptr<std::atomic<long long>[]> ids_;
+  std::atomic<std::size_t> size_;
+};
+
+}
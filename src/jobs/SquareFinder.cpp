@@ -182,6 +182,9 @@ void SquareFinder::determineSquares(const std::vector<unsigned char> &buf,
   squares_.push_back({determineSquare(buf, w, h, x, y), 0 , 0});
   const Wt::WRectF &rect = squares_[0].rect;
 
+  squareIndex_ = RectIndex(std::max(rect.width(), rect.height()));
+  squareIndex_.insert(rect, 0);
+
   const Wt::WPointF center = rect.center();
   const int c_x = static_cast<int>(center.x());
   const int c_y = static_cast<int>(center.y());
@@ -224,10 +227,7 @@ void SquareFinder::determineSquares(const std::vector<unsigned char> &buf,
         cur_y >= h - 1)
       continue;
 
-    auto it = std::find_if(begin(squares_), end(squares_), [point=Wt::WPointF(cur_x, cur_y)](const Square &other) {
-      return other.rect.contains(point);
-    });
-    if (it != end(squares_))
+    if (squareIndex_.contains(Wt::WPointF(cur_x, cur_y)))
       continue;
 
     const Wt::WRectF sq = determineSquare(buf, w, h, cur_x, cur_y);
@@ -243,6 +243,7 @@ void SquareFinder::determineSquares(const std::vector<unsigned char> &buf,
         area > 1.3 * prev_area)
       continue;
 
+    squareIndex_.insert(sq, static_cast<int>(squares_.size()));
     squares_.push_back({sq, row, col});
 
     const int new_c_x = static_cast<int>(c.x());
@@ -280,19 +281,10 @@ void SquareFinder::populatePuzzle()
   const int nRows = maxRow - minRow + 1;
   const int nCols = maxCol - minCol + 1;
 
-  puzzle_.rows_.clear();
-
-  for (int r = 0; r < nRows; ++r) {
-    auto &row = puzzle_.rows_.emplace_back();
-    for (int c = 0; c < nCols; ++c) {
-      row.emplace_back();
-    }
-  }
+  puzzle_.grid_ = CellGrid(nRows, nCols);
 
   for (auto &square : squares_) {
-    Puzzle::Row &row = puzzle_.rows_[static_cast<std::size_t>(square.row + rowOffset)];
-    Cell &cell = row[static_cast<std::size_t>(square.col + colOffset)];
-    cell.square = square.rect;
+    puzzle_.grid_.setSquare({square.row + rowOffset, square.col + colOffset}, square.rect);
   }
 }
 
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include "../RectIndex.h"
 #include "../Rotation.h"
 #include "../model/Puzzle.h"
 
@@ -48,6 +49,7 @@ private:
   std::promise<void> stopSignal_;
   std::future<void> stopFuture_;
   std::vector<Square> squares_;
+  RectIndex squareIndex_; // the rects of squares_
   Wt::Signal<Status> statusChanged_;
   Wt::WApplication *app_;
   Wt::WServer *server_;
@@ -15,7 +15,11 @@
 
 #include "Application.h"
 #include "Dispatcher.h"
+#include "PuzzleRouter.h"
+#include "Replicator.h"
 #include "SharedSession.h"
+#include "StatsResource.h"
+#include "UserRegistry.h"
 
 #include "model/Puzzle.h"
 #include "model/Session.h"
@@ -23,7 +27,14 @@
 
 #include "widgets/PuzzleView.h"
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 int main(int argc, char *argv[]) {
   using namespace swedish;
@@ -39,24 +50,122 @@ int main(int argc, char *argv[]) {
   }
   auto conn = std::make_unique<Wt::Dbo::backend::Postgres>(connStr);
 
-  auto sharedSession = std::make_shared<SharedSession>(&server.ioService(), conn->clone());
-  Dispatcher dispatcher(&server);
+  auto readIntProperty = [&server](const std::string &name, int &value) {
+    std::string str;
+    if (!server.readConfigurationProperty(name, str))
+      return;
+    try {
+      value = std::stoi(str);
+    } catch (std::logic_error &) {
+      Wt::log("error") << "Swedish" << ": Invalid value for '" << name << "': " << str;
+    }
+  };
+
+  SyncSettings syncSettings;
+  {
+    int intervalMs = -1;
+    int maxAgeMs = -1;
+    int dirtyCells = -1;
+    readIntProperty("sync_interval_ms", intervalMs);
+    readIntProperty("sync_max_age_ms", maxAgeMs);
+    readIntProperty("sync_dirty_cells", dirtyCells);
+    if (intervalMs > 0) {
+      syncSettings.interval = std::chrono::milliseconds(intervalMs);
+    }
+    if (maxAgeMs > 0) {
+      syncSettings.maxAge = std::chrono::milliseconds(maxAgeMs);
+    }
+    if (dirtyCells > 0) {
+      syncSettings.dirtyCells = dirtyCells;
+    }
+  }
+
+  // one registry for the whole process, so user indices mean the same everywhere
+  UserRegistry userRegistry;
+  auto sharedSession = std::make_shared<SharedSession>(&server.ioService(), conn->clone(), userRegistry);
+  sharedSession->setSyncSettings(syncSettings);
+  Dispatcher dispatcher(&server, userRegistry);
+  {
+    int inboxCapacity = -1;
+    readIntProperty("inbox_capacity", inboxCapacity);
+    if (inboxCapacity > 0) {
+      dispatcher.setInboxCapacity(static_cast<std::size_t>(inboxCapacity));
+    }
+  }
+
+  std::unique_ptr<Replicator> replicator;
+  std::string replicationChannel;
+  if (server.readConfigurationProperty("replication_channel", replicationChannel)) {
+    replicator = std::make_unique<Replicator>(connStr, replicationChannel, *sharedSession, dispatcher);
+    dispatcher.setReplicator(replicator.get());
+  }
 
   conn->setProperty("show-queries", "true");
 
   Wt::Dbo::FixedSqlConnectionPool pool(std::move(conn), 10);
 
+  std::unique_ptr<PuzzleRouter> puzzleRouter;
+  std::string shardWorkers;
+  if (server.readConfigurationProperty("shard_workers", shardWorkers)) {
+    std::vector<std::string> workers;
+    std::istringstream ss(shardWorkers);
+    for (std::string worker; ss >> worker;) {
+      workers.push_back(worker);
+    }
+
+    std::string shardWorker;
+    server.readConfigurationProperty("shard_worker", shardWorker);
+    if (std::find(begin(workers), end(workers), shardWorker) == end(workers)) {
+      Wt::log("error") << "Swedish" << ": 'shard_worker' must be one of 'shard_workers'";
+      return -1;
+    }
+    if (replicator) {
+      Wt::log("warning") << "Swedish" << ": Both sharding and replication are configured, you probably only want one";
+    }
+
+    puzzleRouter = std::make_unique<PuzzleRouter>(workers, shardWorker);
+  }
+
+  int prewarmPuzzles = 10;
+  int prewarmConnections = 4;
+  readIntProperty("prewarm_puzzles", prewarmPuzzles);
+  readIntProperty("prewarm_connections", prewarmConnections);
+  try {
+    // without sharding, every puzzle is local, and the database can do the limiting
+    std::function<bool(long long)> isLocal;
+    if (puzzleRouter) {
+      isLocal = [&puzzleRouter](long long id) {
+        return puzzleRouter->isLocal(id);
+      };
+    }
+    sharedSession->prewarm(pool, prewarmPuzzles, prewarmConnections, isLocal);
+  } catch (const Wt::Dbo::Exception &e) {
+    Wt::log("error") << "Swedish" << ": Could not prewarm puzzle cache: " << e.what();
+  }
+
+  StatsResource statsResource(dispatcher);
+  std::string statsPath;
+  if (server.readConfigurationProperty("stats_path", statsPath)) {
+    server.addResource(&statsResource, statsPath);
+  }
+
   server.addEntryPoint(Wt::EntryPointType::Application,
-                       [&pool,sharedSession=std::ref(*sharedSession),&dispatcher](const Wt::WEnvironment &env) {
-    return std::make_unique<Application>(env, pool, sharedSession, dispatcher);
+                       [&pool,sharedSession=std::ref(*sharedSession),&dispatcher,router=puzzleRouter.get()](const Wt::WEnvironment &env) {
+    return std::make_unique<Application>(env, pool, sharedSession, dispatcher, router);
   });
 
   if (server.start()) {
+    if (replicator) {
+      replicator->start();
+    }
     sharedSession->startTimer();
     int sig = Wt::WServer::waitForShutdown();
     Wt::log("info") << "Swedish" << ": Shutdown received, sig = " << sig;
     sharedSession->stopTimer();
     server.stop();
+    if (replicator) {
+      replicator->stop();
+    }
     sharedSession = nullptr;
   }
 }
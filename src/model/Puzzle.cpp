@@ -3,15 +3,19 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #include "Puzzle.h"
+#include "Session.h"
 
+#include <Wt/Dbo/Exception.h>
 #include <Wt/Dbo/Impl.h>
 #include <Wt/Dbo/WtSqlTraits.h>
 
-#include <Wt/Json/Array.h>
-#include <Wt/Json/Parser.h>
-#include <Wt/Json/Serializer.h>
-#include <Wt/Json/Value.h>
+#include <Wt/WLogger.h>
 
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <string>
 #include <string_view>
 
 using namespace std::string_view_literals;
@@ -20,6 +24,257 @@ namespace {
 
 const std::string_view alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"sv;
 
+constexpr const std::uint8_t legacyBinaryFormatVersion = 1;
+constexpr const std::uint8_t geometryFormatVersion = 2;
+constexpr const std::uint8_t stateFormatVersion = 1;
+constexpr const int characterBits = 5;
+// more rows or columns than this means the data is corrupt
+constexpr const std::uint64_t maxGridSize = 1000;
+
+class BinaryWriter final {
+public:
+  void byte(std::uint8_t b)
+  {
+    data_.push_back(b);
+  }
+
+  void varint(std::uint64_t value)
+  {
+    while (value >= 0x80) {
+      data_.push_back(static_cast<unsigned char>((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    data_.push_back(static_cast<unsigned char>(value));
+  }
+
+  // zigzag encoded, so small negative numbers stay small
+  void signedVarint(std::int64_t value)
+  {
+    varint((static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63));
+  }
+
+  std::vector<unsigned char> take() { return std::move(data_); }
+
+private:
+  std::vector<unsigned char> data_;
+};
+
+// reads past the end return 0 and set failed()
+class BinaryReader final {
+public:
+  explicit BinaryReader(const std::vector<unsigned char> &data)
+    : data_(data)
+  { }
+
+  std::uint8_t byte()
+  {
+    if (pos_ == data_.size()) {
+      failed_ = true;
+      return 0;
+    }
+    return data_[pos_++];
+  }
+
+  std::uint64_t varint()
+  {
+    std::uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      const std::uint8_t b = byte();
+      result |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+      if (!(b & 0x80))
+        break;
+    }
+    return result;
+  }
+
+  std::int64_t signedVarint()
+  {
+    const std::uint64_t value = varint();
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+  }
+
+  bool failed() const { return failed_; }
+
+  std::size_t remaining() const { return data_.size() - pos_; }
+
+private:
+  const std::vector<unsigned char> &data_;
+  std::size_t pos_ = 0;
+  bool failed_ = false;
+};
+
+// A streaming reader for JSON, for the legacy format of the data column.
+// Values are read as the caller walks the document, no tree is built.
+// After a syntax error failed() is set and every read returns nothing.
+class JsonReader final {
+public:
+  // json is null terminated, so numbers can be parsed in place
+  explicit JsonReader(const std::string &json)
+    : json_(json)
+  { }
+
+  bool failed() const { return failed_; }
+
+  // calls member(key) for every member, which must read or skip its value
+  template<typename Member>
+  void object(Member &&member)
+  {
+    if (!expect('{') || consume('}'))
+      return;
+
+    do {
+      const std::string_view key = string();
+      if (!expect(':'))
+        return;
+      member(key);
+    } while (!failed_ && consume(','));
+
+    expect('}');
+  }
+
+  // calls element(index) for every element, which must read or skip it
+  template<typename Element>
+  void array(Element &&element)
+  {
+    if (!expect('[') || consume(']'))
+      return;
+
+    int i = 0;
+    do {
+      element(i++);
+    } while (!failed_ && consume(','));
+
+    expect(']');
+  }
+
+  // consumes null, returns false if the next value is not null
+  bool null()
+  {
+    skipWhitespace();
+    if (json_.compare(pos_, 4, "null") != 0)
+      return false;
+    pos_ += 4;
+    return true;
+  }
+
+  double number()
+  {
+    skipWhitespace();
+    const char *begin = json_.c_str() + pos_;
+    char *end = nullptr;
+    const double result = std::strtod(begin, &end);
+    if (end == begin) {
+      fail();
+      return 0.0;
+    }
+    pos_ += static_cast<std::size_t>(end - begin);
+    return result;
+  }
+
+  // returns the contents of the string, escape sequences are not decoded
+  std::string_view string()
+  {
+    if (!expect('"'))
+      return {};
+
+    const std::size_t begin = pos_;
+    while (pos_ < json_.size() && json_[pos_] != '"') {
+      pos_ += json_[pos_] == '\\' ? 2 : 1;
+    }
+    if (pos_ >= json_.size()) {
+      fail();
+      return {};
+    }
+    return std::string_view(json_).substr(begin, pos_++ - begin);
+  }
+
+  void skipValue()
+  {
+    skipWhitespace();
+    if (pos_ == json_.size()) {
+      fail();
+    } else if (json_[pos_] == '{') {
+      object([this](std::string_view) { skipValue(); });
+    } else if (json_[pos_] == '[') {
+      array([this](int) { skipValue(); });
+    } else if (json_[pos_] == '"') {
+      string();
+    } else if (null()) {
+      return;
+    } else if (json_.compare(pos_, 4, "true") == 0) {
+      pos_ += 4;
+    } else if (json_.compare(pos_, 5, "false") == 0) {
+      pos_ += 5;
+    } else {
+      number();
+    }
+  }
+
+private:
+  const std::string &json_;
+  std::size_t pos_ = 0;
+  bool failed_ = false;
+
+  void fail()
+  {
+    failed_ = true;
+    pos_ = json_.size();
+  }
+
+  void skipWhitespace()
+  {
+    while (pos_ < json_.size() &&
+           (json_[pos_] == ' ' || json_[pos_] == '\n' || json_[pos_] == '\r' || json_[pos_] == '\t')) {
+      ++pos_;
+    }
+  }
+
+  bool consume(char c)
+  {
+    skipWhitespace();
+    if (pos_ < json_.size() && json_[pos_] == c) {
+      ++pos_;
+      return true;
+    }
+    return false;
+  }
+
+  bool expect(char c)
+  {
+    if (!consume(c)) {
+      fail();
+      return false;
+    }
+    return true;
+  }
+};
+
+// reads the characters, 5 bits each, followed by the users
+void readCellValues(BinaryReader &reader,
+                    swedish::CellGrid &grid,
+                    const std::vector<std::pair<int, int>> &cellRefs)
+{
+  std::vector<swedish::Character> characters;
+  characters.reserve(cellRefs.size());
+
+  std::uint32_t bits = 0;
+  int bitCount = 0;
+  for (std::size_t i = 0; i < cellRefs.size(); ++i) {
+    while (bitCount < characterBits) {
+      bits |= static_cast<std::uint32_t>(reader.byte()) << bitCount;
+      bitCount += 8;
+    }
+    const auto character = static_cast<std::uint8_t>(bits & ((1u << characterBits) - 1));
+    characters.push_back(character <= static_cast<std::uint8_t>(swedish::Character::IJ) ? static_cast<swedish::Character>(character) : swedish::Character::None);
+    bits >>= characterBits;
+    bitCount -= characterBits;
+  }
+
+  for (std::size_t i = 0; i < cellRefs.size(); ++i) {
+    grid.setValue(cellRefs[i], characters[i], static_cast<long long>(reader.varint()) - 1);
+  }
+}
+
 }
 
 namespace swedish {
@@ -50,70 +305,357 @@ Character strToChar(std::string_view str)
     return Character::None; // TODO(Roel): this is an error!
 }
 
-Wt::Json::Object Puzzle::encodeJson() const
+SquareGrid::SquareGrid() = default;
+
+SquareGrid::SquareGrid(int rowCount, int colCount)
+  : rowCount_(rowCount),
+    colCount_(colCount)
+{
+  const auto size = static_cast<std::size_t>(rowCount * colCount);
+  present_.resize((size + 63) / 64, 0);
+  x_.resize(size, 0.0f);
+  y_.resize(size, 0.0f);
+  width_.resize(size, 0.0f);
+  height_.resize(size, 0.0f);
+}
+
+Wt::WRectF SquareGrid::square(std::pair<int, int> cellRef) const
+{
+  if (isNull(cellRef))
+    return Wt::WRectF();
+
+  const std::size_t i = index(cellRef);
+  return Wt::WRectF(x_[i], y_[i], width_[i], height_[i]);
+}
+
+void SquareGrid::setSquare(std::pair<int, int> cellRef, const Wt::WRectF &square)
+{
+  const std::size_t i = index(cellRef);
+  const std::uint64_t bit = std::uint64_t{1} << (i % 64);
+
+  if (square.isNull()) {
+    present_[i / 64] &= ~bit;
+    x_[i] = y_[i] = width_[i] = height_[i] = 0.0f;
+  } else {
+    present_[i / 64] |= bit;
+    x_[i] = static_cast<float>(square.x());
+    y_[i] = static_cast<float>(square.y());
+    width_[i] = static_cast<float>(square.width());
+    height_[i] = static_cast<float>(square.height());
+  }
+}
+
+CellGrid::CellGrid() = default;
+
+CellGrid::CellGrid(int rowCount, int colCount, UserRegistry *userRegistry)
+  : squares_(rowCount, colCount),
+    characters_(static_cast<std::size_t>(rowCount * colCount), Character::None),
+    users_(static_cast<std::size_t>(rowCount * colCount), UserRegistry::noUser),
+    userRegistry_(userRegistry)
+{ }
+
+void CellGrid::setValue(std::pair<int, int> cellRef, Character character, long long user)
+{
+  if (user != -1 && !userRegistry_) {
+    Wt::log("error") << "swedish::CellGrid" << ": no user registry, dropping user " << user;
+  }
+
+  characters_[index(cellRef)] = character;
+  users_[index(cellRef)] = userRegistry_ ? userRegistry_->indexOf(user) : UserRegistry::noUser;
+}
+
+Cell CellGrid::cell(std::pair<int, int> cellRef) const
+{
+  Cell result;
+  result.square = square(cellRef);
+  result.character_ = character(cellRef);
+  result.user_ = user(cellRef);
+  return result;
+}
+
+std::vector<unsigned char> encodeState(const std::vector<std::pair<Character, long long>> &cells)
 {
-  Wt::Json::Object result;
-
-  result["width"] = width;
-  result["height"] = height;
-  result["rotation"] = rotationToDegrees(rotation);
-
-  Wt::Json::Array &json_rows = result["rows"] = Wt::Json::Value(Wt::Json::Type::Array);
-
-  for (const Row &row : rows_) {
-    json_rows.push_back(Wt::Json::Value(Wt::Json::Type::Array));
-    Wt::Json::Array &json_row = json_rows.back();
-    for (const Cell &cell : row) {
-      if (cell.isNull()) {
-        json_row.push_back(Wt::Json::Value(Wt::Json::Type::Null));
-      } else {
-        json_row.push_back(Wt::Json::Value(Wt::Json::Type::Object));
-        Wt::Json::Object &json_cell = json_row.back();
-        Wt::Json::Array &json_rect = json_cell["rect"] = Wt::Json::Value(Wt::Json::Type::Array);
-        json_rect.push_back(static_cast<int>(cell.square.x()));
-        json_rect.push_back(static_cast<int>(cell.square.y()));
-        json_rect.push_back(static_cast<int>(cell.square.width()));
-        json_rect.push_back(static_cast<int>(cell.square.height()));
-        json_cell["value"] = Wt::utf8(std::string(charToStr(cell.character_)));
-        json_cell["user"] = cell.user_;
+  BinaryWriter writer;
+
+  writer.byte(stateFormatVersion);
+  writer.varint(cells.size());
+
+  // characters, 5 bits each
+  {
+    std::uint32_t bits = 0;
+    int bitCount = 0;
+    for (const auto &cell : cells) {
+      bits |= static_cast<std::uint32_t>(cell.first) << bitCount;
+      bitCount += characterBits;
+      while (bitCount >= 8) {
+        writer.byte(static_cast<std::uint8_t>(bits & 0xFF));
+        bits >>= 8;
+        bitCount -= 8;
       }
     }
+    if (bitCount != 0) {
+      writer.byte(static_cast<std::uint8_t>(bits & 0xFF));
+    }
   }
 
+  // users, offset by one so no user (-1) is 0
+  for (const auto &cell : cells) {
+    writer.varint(static_cast<std::uint64_t>(cell.second + 1));
+  }
+
+  return writer.take();
+}
+
+std::vector<std::pair<Character, long long>> Puzzle::cellValues() const
+{
+  std::vector<std::pair<Character, long long>> result;
+  result.reserve(static_cast<std::size_t>(grid_.rowCount() * grid_.colCount()));
+  for (int r = 0; r < grid_.rowCount(); ++r) {
+    for (int c = 0; c < grid_.colCount(); ++c) {
+      result.emplace_back(grid_.character({r, c}), grid_.user({r, c}));
+    }
+  }
   return result;
 }
 
-void Puzzle::decodeJson(const Wt::Json::Object &json)
+std::vector<unsigned char> Puzzle::encodeGeometry() const
 {
-  width = json.get("width");
-  height = json.get("height");
-  rotation = degreesToRotation(json.get("rotation"));
-
-  rows_.clear();
-
-  const Wt::Json::Array &json_rows = json.get("rows");
-
-  for (const Wt::Json::Array &json_row : json_rows) {
-    std::vector<Cell> &row = rows_.emplace_back();
-    for (const Wt::Json::Value &json_cell : json_row) {
-      if (json_cell.isNull()) {
-        row.push_back(Cell());
-      } else {
-        const Wt::Json::Object &json_cell_o = json_cell;
-        const Wt::Json::Array &json_rect = json_cell_o.get("rect");
-        assert(json_rect.size() == 4);
-        Cell &cell = row.emplace_back();
-        cell.square = Wt::WRectF(json_rect[0].toNumber(),
-                                 json_rect[1].toNumber(),
-                                 json_rect[2].toNumber(),
-                                 json_rect[3].toNumber());
-        Wt::WString value = json_cell_o.get("value");
-        cell.character_ = strToChar(value.toUTF8());
-        long long user = json_cell_o.get("user").orIfNull(-1);
-        cell.user_ = user;
+  BinaryWriter writer;
+
+  writer.byte(geometryFormatVersion);
+  writer.varint(static_cast<std::uint64_t>(width));
+  writer.varint(static_cast<std::uint64_t>(height));
+  writer.byte(static_cast<std::uint8_t>(rotation));
+  writer.varint(static_cast<std::uint64_t>(grid_.rowCount()));
+  writer.varint(static_cast<std::uint64_t>(grid_.colCount()));
+
+  // null mask, one bit per cell, set if the cell exists
+  std::vector<std::pair<int, int>> cellRefs;
+  {
+    std::uint8_t bits = 0;
+    int bitCount = 0;
+    for (int r = 0; r < grid_.rowCount(); ++r) {
+      for (int c = 0; c < grid_.colCount(); ++c) {
+        if (!grid_.isNull({r, c})) {
+          bits |= static_cast<std::uint8_t>(1 << bitCount);
+          cellRefs.emplace_back(r, c);
+        }
+        if (++bitCount == 8) {
+          writer.byte(bits);
+          bits = 0;
+          bitCount = 0;
+        }
+      }
+    }
+    if (bitCount != 0) {
+      writer.byte(bits);
+    }
+  }
+
+  // rectangles, every coordinate as the difference with the previous cell
+  {
+    std::int64_t previous[4] = { 0, 0, 0, 0 };
+    for (const auto &cellRef : cellRefs) {
+      const Wt::WRectF square = grid_.square(cellRef);
+      const std::int64_t current[4] = {
+        static_cast<std::int64_t>(square.x()),
+        static_cast<std::int64_t>(square.y()),
+        static_cast<std::int64_t>(square.width()),
+        static_cast<std::int64_t>(square.height())
+      };
+      for (int i = 0; i < 4; ++i) {
+        writer.signedVarint(current[i] - previous[i]);
+        previous[i] = current[i];
       }
     }
   }
+
+  return writer.take();
+}
+
+UserRegistry *Puzzle::userRegistry(Wt::Dbo::Session *session)
+{
+  const auto swedishSession = dynamic_cast<Session *>(session);
+  return swedishSession ? &swedishSession->userRegistry() : nullptr;
+}
+
+void Puzzle::decodeBinary(const std::vector<unsigned char> &data,
+                          const std::vector<unsigned char> &state,
+                          UserRegistry *userRegistry)
+{
+  // Corrupt geometry fails the load, rather than showing a blank or
+  // partial puzzle. The Dbo::Exception is handled like a database error.
+  BinaryReader reader(data);
+
+  // version 1 stored the characters and users after the geometry,
+  // those puzzles are written back in the current format
+  const std::uint8_t version = reader.byte();
+  if (version != geometryFormatVersion &&
+      version != legacyBinaryFormatVersion) {
+    throw Wt::Dbo::Exception("swedish::Puzzle: unknown binary format version " + std::to_string(version));
+  }
+
+  const std::uint64_t newWidth = reader.varint();
+  const std::uint64_t newHeight = reader.varint();
+  const auto newRotation = static_cast<Rotation>(reader.byte() % 4);
+  const std::uint64_t rows = reader.varint();
+  const std::uint64_t cols = reader.varint();
+
+  // the null mask has a bit for every cell, so it also bounds the grid size
+  if (reader.failed() ||
+      newWidth > static_cast<std::uint64_t>(std::numeric_limits<int>::max()) ||
+      newHeight > static_cast<std::uint64_t>(std::numeric_limits<int>::max()) ||
+      rows > maxGridSize ||
+      cols > maxGridSize ||
+      (rows * cols + 7) / 8 > reader.remaining()) {
+    throw Wt::Dbo::Exception("swedish::Puzzle: corrupt binary data");
+  }
+
+  needsMigration_ = version == legacyBinaryFormatVersion;
+  width = static_cast<int>(newWidth);
+  height = static_cast<int>(newHeight);
+  rotation = newRotation;
+  const auto rowCount = static_cast<int>(rows);
+  const auto colCount = static_cast<int>(cols);
+
+  grid_ = CellGrid(rowCount, colCount, userRegistry);
+
+  std::vector<std::pair<int, int>> cellRefs;
+  {
+    std::uint8_t bits = 0;
+    int bitCount = 0;
+    for (int r = 0; r < rowCount; ++r) {
+      for (int c = 0; c < colCount; ++c) {
+        if (bitCount == 0) {
+          bits = reader.byte();
+          bitCount = 8;
+        }
+        if (bits & 1) {
+          cellRefs.emplace_back(r, c);
+        }
+        bits >>= 1;
+        --bitCount;
+      }
+    }
+  }
+
+  {
+    std::int64_t previous[4] = { 0, 0, 0, 0 };
+    for (const auto &cellRef : cellRefs) {
+      for (int i = 0; i < 4; ++i) {
+        previous[i] += reader.signedVarint();
+      }
+      grid_.setSquare(cellRef, Wt::WRectF(static_cast<double>(previous[0]),
+                                          static_cast<double>(previous[1]),
+                                          static_cast<double>(previous[2]),
+                                          static_cast<double>(previous[3])));
+    }
+  }
+
+  if (version == legacyBinaryFormatVersion) {
+    readCellValues(reader, grid_, cellRefs);
+  }
+
+  if (reader.failed()) {
+    throw Wt::Dbo::Exception("swedish::Puzzle: truncated binary data");
+  }
+
+  if (version == legacyBinaryFormatVersion ||
+      state.empty()) {
+    return;
+  }
+
+  // the state has an entry for every cell, null or not
+  cellRefs.clear();
+  for (int r = 0; r < rowCount; ++r) {
+    for (int c = 0; c < colCount; ++c) {
+      cellRefs.emplace_back(r, c);
+    }
+  }
+
+  BinaryReader stateReader(state);
+  const std::uint8_t stateVersion = stateReader.byte();
+  const auto cellCount = static_cast<std::size_t>(stateReader.varint());
+  if (stateVersion != stateFormatVersion ||
+      cellCount != cellRefs.size()) {
+    Wt::log("error") << "swedish::Puzzle" << ": state does not match geometry, ignoring it";
+    return;
+  }
+
+  readCellValues(stateReader, grid_, cellRefs);
+
+  if (stateReader.failed()) {
+    Wt::log("error") << "swedish::Puzzle" << ": truncated state";
+  }
+}
+
+void Puzzle::decodeJson(const std::string &json,
+                        UserRegistry *userRegistry)
+{
+  // { "width": w, "height": h, "rotation": degrees,
+  //   "rows": [[null or { "rect": [x, y, w, h], "value": "A", "user": id or null }, ...], ...] }
+  struct JsonCell {
+    std::pair<int, int> cellRef;
+    double rect[4] = { 0.0, 0.0, 0.0, 0.0 };
+    Character character = Character::None;
+    long long user = -1;
+  };
+
+  std::vector<JsonCell> cells;
+  int rowCount = 0;
+  int colCount = 0;
+
+  JsonReader reader(json);
+  reader.object([&](std::string_view key) {
+    if (key == "width"sv) {
+      width = static_cast<int>(reader.number());
+    } else if (key == "height"sv) {
+      height = static_cast<int>(reader.number());
+    } else if (key == "rotation"sv) {
+      rotation = degreesToRotation(static_cast<int>(reader.number()));
+    } else if (key == "rows"sv) {
+      reader.array([&](int r) {
+        rowCount = r + 1;
+        reader.array([&](int c) {
+          colCount = std::max(colCount, c + 1);
+          if (reader.null())
+            return;
+
+          JsonCell &cell = cells.emplace_back();
+          cell.cellRef = { r, c };
+          reader.object([&](std::string_view cellKey) {
+            if (cellKey == "rect"sv) {
+              reader.array([&](int i) {
+                const double value = reader.number();
+                if (i < 4)
+                  cell.rect[i] = value;
+              });
+            } else if (cellKey == "value"sv) {
+              cell.character = strToChar(reader.string());
+            } else if (cellKey == "user"sv) {
+              cell.user = reader.null() ? -1 : static_cast<long long>(reader.number());
+            } else {
+              reader.skipValue();
+            }
+          });
+        });
+      });
+    } else {
+      reader.skipValue();
+    }
+  });
+
+  // a partly read grid would be migrated to binary data, losing the rest
+  if (reader.failed()) {
+    throw Wt::Dbo::Exception("swedish::Puzzle: invalid JSON data");
+  }
+
+  grid_ = CellGrid(rowCount, colCount, userRegistry);
+
+  for (const JsonCell &cell : cells) {
+    grid_.setSquare(cell.cellRef, Wt::WRectF(cell.rect[0], cell.rect[1], cell.rect[2], cell.rect[3]));
+    grid_.setValue(cell.cellRef, cell.character, cell.user);
+  }
 }
 
 }
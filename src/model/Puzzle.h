@@ -5,15 +5,16 @@
 #pragma once
 
 #include "../Rotation.h"
+#include "../UserRegistry.h"
 
 #include <Wt/WRectF.h>
 
 #include <Wt/Dbo/Types.h>
 
-#include <Wt/Json/Object.h>
-
 #include <cstdint>
+#include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 namespace swedish {
@@ -53,6 +54,10 @@ extern std::string_view charToStr(Character character);
 
 extern Character strToChar(std::string_view str);
 
+// The characters and users of all cells of a puzzle, row major, as
+// (character, userid), in the format of the state column
+extern std::vector<unsigned char> encodeState(const std::vector<std::pair<Character, long long>> &cells);
+
 struct Cell final {
   Wt::WRectF square;
   Character character_ = Character::None;
@@ -64,6 +69,84 @@ struct Cell final {
   }
 };
 
+// The rectangles of the cells of a puzzle as one flat, row major grid, stored
+// as a structure of arrays: a bitset of the cells that exist, and the
+// coordinates as floats.
+class SquareGrid final {
+public:
+  SquareGrid();
+  SquareGrid(int rowCount, int colCount); // all cells null
+
+  [[nodiscard]] int rowCount() const { return rowCount_; }
+  [[nodiscard]] int colCount() const { return colCount_; }
+
+  [[nodiscard]] bool isNull(std::pair<int, int> cellRef) const
+  {
+    const std::size_t i = index(cellRef);
+    return !(present_[i / 64] & (std::uint64_t{1} << (i % 64)));
+  }
+
+  // a null rectangle if the cell doesn't exist
+  [[nodiscard]] Wt::WRectF square(std::pair<int, int> cellRef) const;
+
+  // setting a null rectangle removes the cell
+  void setSquare(std::pair<int, int> cellRef, const Wt::WRectF &square);
+
+private:
+  int rowCount_ = 0;
+  int colCount_ = 0;
+  std::vector<std::uint64_t> present_;
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<float> width_;
+  std::vector<float> height_;
+
+  [[nodiscard]] std::size_t index(std::pair<int, int> cellRef) const
+  {
+    return static_cast<std::size_t>(cellRef.first * colCount_ + cellRef.second);
+  }
+};
+
+// A SquareGrid with the character and user of every cell. Users are stored as
+// their index in the UserRegistry of the process, a grid without a registry
+// (a puzzle that is being uploaded) has no users.
+class CellGrid final {
+public:
+  CellGrid();
+  CellGrid(int rowCount, int colCount, UserRegistry *userRegistry = nullptr); // all cells null
+
+  [[nodiscard]] int rowCount() const { return squares_.rowCount(); }
+  [[nodiscard]] int colCount() const { return squares_.colCount(); }
+
+  [[nodiscard]] const SquareGrid &squares() const { return squares_; }
+
+  [[nodiscard]] bool isNull(std::pair<int, int> cellRef) const { return squares_.isNull(cellRef); }
+  [[nodiscard]] Wt::WRectF square(std::pair<int, int> cellRef) const { return squares_.square(cellRef); }
+  void setSquare(std::pair<int, int> cellRef, const Wt::WRectF &square) { squares_.setSquare(cellRef, square); }
+
+  [[nodiscard]] Character character(std::pair<int, int> cellRef) const { return characters_[index(cellRef)]; }
+  [[nodiscard]] UserRegistry::Index userIndex(std::pair<int, int> cellRef) const { return users_[index(cellRef)]; }
+  [[nodiscard]] long long user(std::pair<int, int> cellRef) const
+  {
+    return userRegistry_ ? userRegistry_->userId(userIndex(cellRef)) : -1;
+  }
+
+  void setValue(std::pair<int, int> cellRef, Character character, long long user);
+
+  [[nodiscard]] Cell cell(std::pair<int, int> cellRef) const;
+
+private:
+  SquareGrid squares_;
+  std::vector<Character> characters_;
+  std::vector<UserRegistry::Index> users_;
+  UserRegistry *userRegistry_ = nullptr;
+
+  [[nodiscard]] std::size_t index(std::pair<int, int> cellRef) const
+  {
+    return static_cast<std::size_t>(cellRef.first * colCount() + cellRef.second);
+  }
+};
+
 class Puzzle final : public Wt::Dbo::Dbo<Puzzle> {
 public:
   std::string path;
@@ -71,32 +154,60 @@ public:
   int width = 0;
   int height = 0;
 
-  using Row = std::vector<Cell>;
-  std::vector<Row> rows_;
+  CellGrid grid_;
+
+  [[nodiscard]] Cell cell(int row, int col) const { return grid_.cell({row, col}); }
 
-  Cell &cell(int row, int col) { return rows_[static_cast<std::size_t>(row)][static_cast<std::size_t>(col)]; }
-  [[nodiscard]] const Cell &cell(int row, int col) const { return rows_[static_cast<std::size_t>(row)][static_cast<std::size_t>(col)]; }
+  // whether this puzzle was loaded from the legacy JSON format,
+  // it will be converted when it is saved
+  [[nodiscard]] bool needsMigration() const { return needsMigration_; }
 
   template<typename Action>
   void persist(Action &a)
   {
     Wt::Dbo::field(a, path, "path");
 
-    Wt::Json::Object data;
+    // Puzzles used to be stored as JSON in the data column. They are now stored
+    // in binary: the geometry, which never changes after upload, in binary_data,
+    // and the characters and users in state. The data column is left empty.
+    //
+    // SharedSession only updates the state column when syncing.
+    std::string data = "{}";
+    std::vector<unsigned char> binaryData;
+    std::vector<unsigned char> state;
     if (a.getsValue()) {
-      data = encodeJson();
+      binaryData = encodeGeometry();
+      state = encodeState(cellValues());
+      needsMigration_ = false;
     }
 
     Wt::Dbo::field(a, data, "data");
+    Wt::Dbo::field(a, binaryData, "binary_data");
+    Wt::Dbo::field(a, state, "state");
 
     if (a.setsValue()) {
-      decodeJson(data);
+      if (binaryData.empty()) {
+        decodeJson(data, userRegistry(a.session()));
+        needsMigration_ = true;
+      } else {
+        decodeBinary(binaryData, state, userRegistry(a.session()));
+      }
     }
   }
 
 private:
-  [[nodiscard]] Wt::Json::Object encodeJson() const;
-  void decodeJson(const Wt::Json::Object &json);
+  bool needsMigration_ = false;
+
+  [[nodiscard]] std::vector<std::pair<Character, long long>> cellValues() const;
+  [[nodiscard]] std::vector<unsigned char> encodeGeometry() const;
+  void decodeBinary(const std::vector<unsigned char> &data,
+                    const std::vector<unsigned char> &state,
+                    UserRegistry *userRegistry);
+  void decodeJson(const std::string &json,
+                  UserRegistry *userRegistry);
+
+  // the registry of the session, see Session
+  static UserRegistry *userRegistry(Wt::Dbo::Session *session);
 };
 
 }
@@ -0,0 +1,115 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "PuzzleGeometry.h"
+
+#include "Puzzle.h"
+
+#include <algorithm>
+
+namespace swedish {
+
+PuzzleGeometry::PuzzleGeometry(const Puzzle &puzzle)
+  : path_(puzzle.path),
+    rotation_(puzzle.rotation),
+    width_(puzzle.width),
+    height_(puzzle.height),
+    squares_(puzzle.grid_.squares())
+{
+  buildNavigation();
+  buildHitIndex();
+}
+
+void PuzzleGeometry::buildHitIndex()
+{
+  // buckets the size of an average cell
+  double totalSize = 0.0;
+  int count = 0;
+  for (int r = 0; r < rowCount(); ++r) {
+    for (int c = 0; c < colCount(); ++c) {
+      if (!isNull({r, c})) {
+        const Wt::WRectF rect = square({r, c});
+        totalSize += std::max(rect.width(), rect.height());
+        ++count;
+      }
+    }
+  }
+
+  hitIndex_ = RectIndex(count == 0 ? 1.0 : totalSize / count);
+
+  for (int r = 0; r < rowCount(); ++r) {
+    for (int c = 0; c < colCount(); ++c) {
+      hitIndex_.insert(square({r, c}), r * colCount() + c);
+    }
+  }
+}
+
+void PuzzleGeometry::buildNavigation()
+{
+  const int rowCount = this->rowCount();
+  const int colCount = this->colCount();
+  const auto size = static_cast<std::size_t>(rowCount * colCount);
+
+  for (std::size_t d = 0; d < 4; ++d) {
+    next_[d].assign(size, -1);
+    adjacent_[d].assign(size, -1);
+  }
+
+  const auto cellIndex = [colCount](int r, int c) {
+    return static_cast<std::int32_t>(r * colCount + c);
+  };
+
+  auto &up = next_[static_cast<std::size_t>(Direction::Up)];
+  auto &right = next_[static_cast<std::size_t>(Direction::Right)];
+  auto &down = next_[static_cast<std::size_t>(Direction::Down)];
+  auto &left = next_[static_cast<std::size_t>(Direction::Left)];
+
+  // one pass in every direction, remembering the last cell that is not null
+  for (int r = 0; r < rowCount; ++r) {
+    std::int32_t last = -1;
+    for (int c = 0; c < colCount; ++c) {
+      left[static_cast<std::size_t>(cellIndex(r, c))] = last;
+      if (!isNull({r, c}))
+        last = cellIndex(r, c);
+    }
+    last = -1;
+    for (int c = colCount - 1; c >= 0; --c) {
+      right[static_cast<std::size_t>(cellIndex(r, c))] = last;
+      if (!isNull({r, c}))
+        last = cellIndex(r, c);
+    }
+  }
+
+  for (int c = 0; c < colCount; ++c) {
+    std::int32_t last = -1;
+    for (int r = 0; r < rowCount; ++r) {
+      up[static_cast<std::size_t>(cellIndex(r, c))] = last;
+      if (!isNull({r, c}))
+        last = cellIndex(r, c);
+    }
+    last = -1;
+    for (int r = rowCount - 1; r >= 0; --r) {
+      down[static_cast<std::size_t>(cellIndex(r, c))] = last;
+      if (!isNull({r, c}))
+        last = cellIndex(r, c);
+    }
+  }
+
+  // adjacent cells are the next cells, if they're right next to this one
+  for (int r = 0; r < rowCount; ++r) {
+    for (int c = 0; c < colCount; ++c) {
+      const auto i = static_cast<std::size_t>(cellIndex(r, c));
+      if (r > 0 && up[i] == cellIndex(r - 1, c))
+        adjacent_[static_cast<std::size_t>(Direction::Up)][i] = up[i];
+      if (c + 1 < colCount && right[i] == cellIndex(r, c + 1))
+        adjacent_[static_cast<std::size_t>(Direction::Right)][i] = right[i];
+      if (r + 1 < rowCount && down[i] == cellIndex(r + 1, c))
+        adjacent_[static_cast<std::size_t>(Direction::Down)][i] = down[i];
+      if (c > 0 && left[i] == cellIndex(r, c - 1))
+        adjacent_[static_cast<std::size_t>(Direction::Left)][i] = left[i];
+    }
+  }
+}
+
+}
@@ -0,0 +1,90 @@
+// SPDX-FileCopyrightText: 2021 Roel Standaert <roel@abittechnical.com>
+//
+// SPDX-License-Identifier: GPL-2.0-only
+
+#pragma once
+
+#include "Puzzle.h"
+
+#include "../Direction.h"
+#include "../RectIndex.h"
+#include "../Rotation.h"
+
+#include <Wt/WRectF.h>
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace swedish {
+
+// The part of a puzzle that doesn't change after it was uploaded: the image
+// and the position of the cells. It is loaded once by SharedSession and shared
+// read only between all sessions showing the puzzle.
+class PuzzleGeometry final {
+public:
+  explicit PuzzleGeometry(const Puzzle &puzzle);
+
+  const std::string &path() const { return path_; }
+  Rotation rotation() const { return rotation_; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  int rowCount() const { return squares_.rowCount(); }
+  int colCount() const { return squares_.colCount(); }
+
+  // a null rectangle if there is no cell at the given position
+  Wt::WRectF square(std::pair<int, int> cellRef) const { return squares_.square(cellRef); }
+
+  bool isNull(std::pair<int, int> cellRef) const { return squares_.isNull(cellRef); }
+
+  // the cell containing the given point, the one with the closest center
+  // if there are more, or (-1, -1) if there is none
+  std::pair<int, int> cellAt(const Wt::WPointF &point) const
+  {
+    return toCellRef(hitIndex_.closest(point));
+  }
+
+  // the closest cell that is not null in the given direction,
+  // skipping over null cells, or (-1, -1) if there is none
+  std::pair<int, int> nextCell(std::pair<int, int> cellRef, Direction direction) const
+  {
+    return toCellRef(next_[static_cast<std::size_t>(direction)][index(cellRef)]);
+  }
+
+  // the adjacent cell in the given direction, or (-1, -1) if it is null
+  std::pair<int, int> adjacentCell(std::pair<int, int> cellRef, Direction direction) const
+  {
+    return toCellRef(adjacent_[static_cast<std::size_t>(direction)][index(cellRef)]);
+  }
+
+private:
+  std::string path_;
+  Rotation rotation_;
+  int width_;
+  int height_;
+  SquareGrid squares_;
+  // per direction, the cell index for every cell, -1 if none
+  std::array<std::vector<std::int32_t>, 4> next_;
+  std::array<std::vector<std::int32_t>, 4> adjacent_;
+  RectIndex hitIndex_;
+
+  void buildNavigation();
+  void buildHitIndex();
+
+  std::size_t index(std::pair<int, int> cellRef) const
+  {
+    return static_cast<std::size_t>(cellRef.first * colCount() + cellRef.second);
+  }
+
+  std::pair<int, int> toCellRef(std::int32_t i) const
+  {
+    if (i < 0)
+      return { -1, -1 };
+    return { i / colCount(), i % colCount() };
+  }
+};
+
+}
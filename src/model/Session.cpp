@@ -9,14 +9,18 @@
 
 namespace swedish {
 
-Session::Session(std::unique_ptr<Wt::Dbo::SqlConnection> conn)
+Session::Session(std::unique_ptr<Wt::Dbo::SqlConnection> conn,
+                 UserRegistry &userRegistry)
+  : userRegistry_(userRegistry)
 {
   setConnection(std::move(conn));
 
   init();
 }
 
-Session::Session(Wt::Dbo::SqlConnectionPool &pool)
+Session::Session(Wt::Dbo::SqlConnectionPool &pool,
+                 UserRegistry &userRegistry)
+  : userRegistry_(userRegistry)
 {
   setConnectionPool(pool);
 
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include "../UserRegistry.h"
+
 #include <Wt/Dbo/Session.h>
 
 #include <memory>
@@ -12,11 +14,18 @@ namespace swedish {
 
 class Session final : public Wt::Dbo::Session {
 public:
-  explicit Session(std::unique_ptr<Wt::Dbo::SqlConnection> conn);
-  explicit Session(Wt::Dbo::SqlConnectionPool &pool);
+  Session(std::unique_ptr<Wt::Dbo::SqlConnection> conn,
+          UserRegistry &userRegistry);
+  Session(Wt::Dbo::SqlConnectionPool &pool,
+          UserRegistry &userRegistry);
   ~Session() override;
 
+  // the users of the puzzles that are loaded get their index from this registry
+  UserRegistry &userRegistry() const { return userRegistry_; }
+
 private:
+  UserRegistry &userRegistry_;
+
   void init();
 };
 
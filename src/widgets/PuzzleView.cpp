@@ -26,8 +26,11 @@
 #include <boost/filesystem/path.hpp>
 
 #include <algorithm>
-#include <cmath>
+#include <cstdint>
+#include <locale>
 #include <memory>
+#include <sstream>
+#include <string>
 #include <utility>
 
 namespace {
@@ -35,6 +38,110 @@ namespace {
 constexpr const double max_zoom = 2.0;
 constexpr const double min_zoom = 0.1;
 
+// Sets up client side rendering on the element of a ClientLayer: a canvas for
+// the letters with one for the cursors on top. squares holds [x, y, width, height]
+// of every cell, row major, null if there is no cell.
+constexpr const char *client_layer_js = R"js(
+function(el, width, height, squares) {
+  function addCanvas() {
+    var canvas = document.createElement('canvas');
+    canvas.style.position = 'absolute';
+    canvas.style.left = '0px';
+    canvas.style.top = '0px';
+    el.appendChild(canvas);
+    return canvas;
+  }
+
+  var letterCanvas = addCanvas();
+  var cursorCanvas = addCanvas();
+  var zoom = 1.0;
+  var letters = {}; // cell index to [text, color]
+  var cursors = {}; // user to [cell index, color, vertical]
+
+  function paintLetter(i) {
+    var s = squares[i];
+    var ctx = letterCanvas.getContext('2d');
+    ctx.clearRect(s[0] * zoom, s[1] * zoom, s[2] * zoom, s[3] * zoom);
+
+    var letter = letters[i];
+    if (!letter)
+      return;
+
+    ctx.font = (0.7 * Math.min(s[2], s[3]) * zoom) + 'px sans-serif';
+    ctx.textAlign = 'center';
+    ctx.textBaseline = 'middle';
+    ctx.fillStyle = letter[1];
+    ctx.fillText(letter[0], (s[0] + s[2] / 2) * zoom, (s[1] + s[3] / 2) * zoom);
+  }
+
+  function paintCursors() {
+    var ctx = cursorCanvas.getContext('2d');
+    ctx.clearRect(0, 0, cursorCanvas.width, cursorCanvas.height);
+
+    for (var user in cursors) {
+      var cursor = cursors[user];
+      var s = squares[cursor[0]];
+      var d = Math.min(s[2], s[3]) * zoom;
+      var x = (s[0] + s[2] / 2) * zoom - d / 2;
+      var y = (s[1] + s[3] / 2) * zoom - d / 2;
+
+      ctx.strokeStyle = cursor[1];
+      ctx.fillStyle = cursor[1];
+      ctx.lineWidth = 1;
+      ctx.strokeRect(x, y, d, d);
+
+      ctx.beginPath();
+      if (cursor[2]) {
+        ctx.moveTo(x + d / 4, y + d);
+        ctx.lineTo(x + d / 2, y + d * 1.25);
+        ctx.lineTo(x + d * 0.75, y + d);
+      } else {
+        ctx.moveTo(x + d, y + d / 4);
+        ctx.lineTo(x + d * 1.25, y + d / 2);
+        ctx.lineTo(x + d, y + d * 0.75);
+      }
+      ctx.closePath();
+      ctx.fill();
+    }
+  }
+
+  function paintAll() {
+    letterCanvas.getContext('2d').clearRect(0, 0, letterCanvas.width, letterCanvas.height);
+    for (var i in letters)
+      paintLetter(i);
+    paintCursors();
+  }
+
+  el.swedish = {
+    setZoom: function(z) {
+      zoom = z;
+      letterCanvas.width = cursorCanvas.width = Math.round(width * zoom);
+      letterCanvas.height = cursorCanvas.height = Math.round(height * zoom);
+      paintAll();
+    },
+    setAll: function(newLetters, newCursors) {
+      letters = newLetters;
+      cursors = newCursors;
+      paintAll();
+    },
+    setLetter: function(i, text, color) {
+      if (text)
+        letters[i] = [text, color];
+      else
+        delete letters[i];
+      paintLetter(i);
+    },
+    setCursor: function(user, i, color, vertical) {
+      if (i < 0)
+        delete cursors[user];
+      else
+        cursors[user] = [i, color, vertical];
+      paintCursors();
+    }
+  };
+}
+)js";
+
 }
 
 namespace swedish {
@@ -45,10 +152,13 @@ public:
   ~Layer() override;
 
   double zoom() const { return puzzleView_->zoom_; }
-  const Puzzle *puzzle() const { return puzzleView_->puzzle_.get(); }
+  const PuzzleGeometry *geometry() const { return puzzleView_->geometry_.get(); }
 
 protected:
   PuzzleView *puzzleView_;
+
+  // paints the (rotated) puzzle image, scaled by the zoom level
+  void paintPuzzle(Wt::WPainter &painter) const;
 };
 
 class PuzzleView::PuzzlePaintedWidget final : public PuzzleView::Layer {
@@ -65,8 +175,77 @@ public:
   explicit TextLayer(PuzzleView *puzzleView);
   ~TextLayer() override;
 
+  // repaints all cells
+  void update();
+
+  // Repaints only the given cell, on top of what the browser already shows.
+  // The puzzle image is painted over the cell first, to erase what was there.
+  // Only on a canvas, otherwise all cells are repainted.
+  void updateCell(CellRef cellRef);
+
 protected:
   void paintEvent(Wt::WPaintDevice *paintDevice) override;
+
+private:
+  bool fullUpdate_ = true;
+  std::vector<CellRef> dirtyCells_; // only if !fullUpdate_
+
+  void paintLetter(Wt::WPainter &painter,
+                   Wt::WFont &font,
+                   CellRef cellRef) const;
+};
+
+// The cursors, on top of the TextLayer. There are only a few of them, so
+// this layer is always repainted completely, and moving a cursor doesn't
+// repaint any letters.
+class PuzzleView::CursorLayer final : public PuzzleView::Layer {
+public:
+  explicit CursorLayer(PuzzleView *puzzleView);
+  ~CursorLayer() override;
+
+protected:
+  void paintEvent(Wt::WPaintDevice *paintDevice) override;
+
+private:
+  void paintCursor(Wt::WPainter &painter,
+                   UserRegistry::Index userIndex,
+                   CellRef cellRef,
+                   Wt::Orientation direction) const;
+};
+
+// Replaces the TextLayer and CursorLayer with client side rendering. The
+// cells are sent to the browser once, after that only changed letters and
+// cursors are sent, so nothing is painted on the server.
+class PuzzleView::ClientLayer final : public Wt::WContainerWidget {
+public:
+  explicit ClientLayer(PuzzleView *puzzleView);
+  ~ClientLayer() override;
+
+  // sends all letters and cursors again
+  void update();
+
+  void updateCell(CellRef cellRef);
+
+  // cellRef (-1, -1) removes the cursor of the user
+  void updateCursor(long long userId,
+                    UserRegistry::Index userIndex,
+                    CellRef cellRef,
+                    Wt::Orientation direction);
+
+  // call after resizing
+  void updateZoom();
+
+private:
+  PuzzleView *puzzleView_;
+
+  const PuzzleGeometry *geometry() const { return puzzleView_->geometry_.get(); }
+  int index(CellRef cellRef) const { return cellRef.first * geometry()->colCount() + cellRef.second; }
+
+  // the text and color arguments for setLetter
+  std::string letterArgs(CellRef cellRef) const;
+  // the color and vertical arguments for setCursor
+  std::string cursorArgs(UserRegistry::Index userIndex,
+                         Wt::Orientation direction) const;
 };
 
 PuzzleView::Layer::Layer(PuzzleView *puzzleView)
@@ -75,23 +254,14 @@ PuzzleView::Layer::Layer(PuzzleView *puzzleView)
 
 PuzzleView::Layer::~Layer() = default;
 
-PuzzleView::PuzzlePaintedWidget::PuzzlePaintedWidget(PuzzleView *puzzleView)
-  : Layer(puzzleView)
-{
-  auto puzzle = puzzleView->puzzle_;
-}
-
-PuzzleView::PuzzlePaintedWidget::~PuzzlePaintedWidget() = default;
-
-void PuzzleView::PuzzlePaintedWidget::paintEvent(Wt::WPaintDevice *paintDevice)
+void PuzzleView::Layer::paintPuzzle(Wt::WPainter &painter) const
 {
-  Wt::WPainter painter(paintDevice);
+  std::string path = geometry()->path();
+  const Rotation rotation = geometry()->rotation();
+  const int w = geometry()->width();
+  const int h = geometry()->height();
 
-  const auto & puzzle = puzzleView_->puzzle_;
-  std::string path = puzzle->path;
-  const Rotation rotation = puzzle->rotation;
-  const int w = puzzle->width;
-  const int h = puzzle->height;
+  painter.save();
 
   painter.scale(zoom(), zoom());
 
@@ -113,6 +283,21 @@ void PuzzleView::PuzzlePaintedWidget::paintEvent(Wt::WPaintDevice *paintDevice)
   }
   Wt::WPainter::Image img(path, app->docRoot() + path);
   painter.drawImage(Wt::WPointF(0.0, 0.0), img);
+
+  painter.restore();
+}
+
+PuzzleView::PuzzlePaintedWidget::PuzzlePaintedWidget(PuzzleView *puzzleView)
+  : Layer(puzzleView)
+{ }
+
+PuzzleView::PuzzlePaintedWidget::~PuzzlePaintedWidget() = default;
+
+void PuzzleView::PuzzlePaintedWidget::paintEvent(Wt::WPaintDevice *paintDevice)
+{
+  Wt::WPainter painter(paintDevice);
+
+  paintPuzzle(painter);
 }
 
 PuzzleView::TextLayer::TextLayer(PuzzleView *puzzleView)
@@ -120,10 +305,36 @@ PuzzleView::TextLayer::TextLayer(PuzzleView *puzzleView)
 {
   setPositionScheme(Wt::PositionScheme::Absolute);
   setOffsets(Wt::WLength(0, Wt::LengthUnit::Pixel), Wt::Side::Top | Wt::Side::Left);
+  // an incremental paint draws over a canvas, inline SVG would grow with every paint
+  setPreferredMethod(Wt::RenderMethod::HtmlCanvas);
 }
 
 PuzzleView::TextLayer::~TextLayer() = default;
 
+void PuzzleView::TextLayer::update()
+{
+  fullUpdate_ = true;
+  dirtyCells_.clear();
+
+  Layer::update();
+}
+
+void PuzzleView::TextLayer::updateCell(CellRef cellRef)
+{
+  if (fullUpdate_)
+    return; // everything is repainted anyway
+
+  // without JavaScript, Wt doesn't use a canvas
+  if (!Wt::WApplication::instance()->environment().javaScript()) {
+    update();
+    return;
+  }
+
+  dirtyCells_.push_back(cellRef);
+
+  Layer::update(Wt::PaintFlag::Update);
+}
+
 void PuzzleView::TextLayer::paintEvent(Wt::WPaintDevice *paintDevice)
 {
   Wt::WPainter painter(paintDevice);
@@ -134,126 +345,66 @@ void PuzzleView::TextLayer::paintEvent(Wt::WPaintDevice *paintDevice)
   Wt::WFont font;
   font.setFamily(Wt::FontFamily::SansSerif);
 
-  const Application *app = Application::instance();
-  const std::vector<UserCursor> userCursors = puzzleView_->type_ == PuzzleViewType::SolvePuzzle ?
-        app->dispatcher().userPositions() : std::vector<UserCursor>();
-
-  for (std::size_t r = 0; r < puzzle()->rows_.size(); ++r) {
-    const auto &row = puzzle()->rows_[r];
-    for (std::size_t c = 0; c < row.size(); ++c) {
-      const auto &cell = row[c];
-      if (cell.isNull()) {
-        continue;
-      }
+  // Wt also repaints everything when the layer is resized, without a call to update()
+  const bool incremental = paintDevice->paintFlags().test(Wt::PaintFlag::Update);
+  const bool onlyDirtyCells = incremental && !fullUpdate_;
 
-      const Wt::WRectF &square = cell.square;
-      const double minSize = std::min(square.width(), square.height());
-
-      auto cellRef = std::make_pair(static_cast<int>(r), static_cast<int>(c));
-      std::vector<std::pair<long long, Wt::Orientation>> cellUsers;
-      for (const auto &cursor : userCursors) {
-        if (cursor.userId == app->user())
-          continue;
-        if (cursor.puzzleId != puzzle()->id())
-          continue;
-        if (cursor.cellRef == cellRef) {
-          cellUsers.emplace_back(cursor.userId, cursor.direction);
+  std::vector<CellRef> cells;
+  if (onlyDirtyCells) {
+    cells.swap(dirtyCells_);
+    std::sort(begin(cells), end(cells));
+    cells.erase(std::unique(begin(cells), end(cells)), end(cells));
+  } else {
+    for (int r = 0; r < geometry()->rowCount(); ++r) {
+      for (int c = 0; c < geometry()->colCount(); ++c) {
+        if (!geometry()->isNull({r, c})) {
+          cells.emplace_back(r, c);
         }
       }
-      if (cellRef == puzzleView_->selectedCell_) {
-        cellUsers.emplace_back(app->user(), puzzleView_->direction_);
-      }
-
-      if (puzzleView_->type_ == PuzzleViewType::SolvePuzzle &&
-          !cellUsers.empty()) {
-        for (const auto &cellUser : cellUsers) {
-          const auto userId = cellUser.first;
-          const auto direction = cellUser.second;
-          const auto &users = app->users();
-          const auto it = std::find_if(begin(users), end(users), [userId](const auto &user) {
-            return user.id == userId;
-          });
-          if (it == end(users)) {
-            painter.setPen(Wt::WPen(Wt::StandardColor::Black));
-          } else {
-            painter.setPen(Wt::WPen(it->color));
-          }
-          painter.setBrush(Wt::BrushStyle::None);
-
-          const Wt::WPointF center = square.center();
-          const double diameter = minSize * zoom();
-          const Wt::WRectF rect = Wt::WRectF(center.x() * zoom() - diameter / 2.0,
-                                             center.y() * zoom() - diameter / 2.0,
-                                             diameter,
-                                             diameter);
-          painter.drawRect(rect);
-
-          Wt::WPainterPath directionArrow;
-          if (direction == Wt::Orientation::Horizontal) {
-            directionArrow.moveTo(rect.right(), rect.center().y() - diameter / 4.0);
-            directionArrow.lineTo(rect.right() + diameter / 4.0, rect.center().y());
-            directionArrow.lineTo(rect.right(), rect.center().y() + diameter / 4.0);
-            directionArrow.closeSubPath();
-          } else {
-            assert(direction == Wt::Orientation::Vertical);
-            directionArrow.moveTo(rect.center().x() - diameter / 4.0, rect.bottom());
-            directionArrow.lineTo(rect.center().x(), rect.bottom() + diameter / 4.0);
-            directionArrow.lineTo(rect.center().x() + diameter / 4.0, rect.bottom());
-            directionArrow.closeSubPath();
-          }
-          painter.fillPath(directionArrow, Wt::WBrush(painter.pen().color()));
-        }
+    }
+  }
+  fullUpdate_ = false;
+  dirtyCells_.clear();
+
+  if (incremental) {
+    // the browser still shows what was painted before, paint the puzzle over it
+    Wt::WPainterPath clipPath;
+    if (onlyDirtyCells) {
+      for (const CellRef &cellRef : cells) {
+        clipPath.addRect(Wt::WTransform().scale(zoom(), zoom()).map(geometry()->square(cellRef)));
       }
+    } else {
+      clipPath.addRect(Wt::WRectF(0.0, 0.0, geometry()->width() * zoom(), geometry()->height() * zoom()));
+    }
 
-      if (puzzleView_->type_ == PuzzleViewType::ViewCells) {
-        painter.setPen(Wt::WPen(Wt::StandardColor::Red));
-        painter.setBrush(Wt::WBrush(Wt::WColor(255, 0, 0, 120)));
-
-        const Wt::WPointF center = square.center();
-        const double w = square.width() * zoom();
-        const double h = square.height() * zoom();
-        const Wt::WRectF rect = Wt::WRectF(center.x() * zoom() - w / 2.0,
-                                           center.y() * zoom() - h / 2.0,
-                                           w,
-                                           h);
-        painter.drawRect(rect);
-      }
+    painter.save();
+    painter.setClipPath(clipPath);
+    painter.setClipping(true);
+    paintPuzzle(painter);
+    painter.restore();
+  }
 
-      if (puzzleView_->type_ == PuzzleViewType::SolvePuzzle) {
-        const SharedSession &session = app->sharedSession();
-        const std::pair<Character, long long> val = session.charAt(puzzle()->id(), cellRef);
-        const Character ch = val.first;
-        const long long userId = val.second;
-
-
-        if (ch != Character::None) {
-          font.setSize(Wt::WLength(0.7 * minSize * zoom()));
-          painter.setFont(font);
-
-          const auto &users = app->users();
-          const auto it = std::find_if(std::begin(users), std::end(users), [userId](const auto &user) {
-            return user.id == userId;
-          });
-          if (it == std::end(users)) {
-            painter.setPen(Wt::WPen(Wt::StandardColor::Black));
-          } else {
-            painter.setPen(Wt::WPen(it->color));
-          }
-          painter.setBrush(Wt::BrushStyle::None);
-
-          std::string str(charToStr(ch));
-
-          painter.drawText(Wt::WTransform().scale(zoom(), zoom()).map(square),
-                           Wt::AlignmentFlag::Center |
-                           Wt::AlignmentFlag::Middle,
-                           Wt::TextFlag::SingleLine,
-                           Wt::utf8(str));
-        }
-      }
+  for (const CellRef &cellRef : cells) {
+    if (puzzleView_->type_ == PuzzleViewType::ViewCells) {
+      painter.setPen(Wt::WPen(Wt::StandardColor::Red));
+      painter.setBrush(Wt::WBrush(Wt::WColor(255, 0, 0, 120)));
+
+      const Wt::WRectF square = geometry()->square(cellRef);
+      const Wt::WPointF center = square.center();
+      const double w = square.width() * zoom();
+      const double h = square.height() * zoom();
+      const Wt::WRectF rect = Wt::WRectF(center.x() * zoom() - w / 2.0,
+                                         center.y() * zoom() - h / 2.0,
+                                         w,
+                                         h);
+      painter.drawRect(rect);
     }
+
+    paintLetter(painter, font, cellRef);
   }
 
-  if (puzzleView_->clickPosition_) {
+  if (!onlyDirtyCells &&
+      puzzleView_->clickPosition_) {
     Wt::WPointF p = puzzleView_->clickPosition_.value();
 
     Wt::WPen pen(Wt::StandardColor::Red);
@@ -270,6 +421,228 @@ void PuzzleView::TextLayer::paintEvent(Wt::WPaintDevice *paintDevice)
   }
 }
 
+PuzzleView::CursorLayer::CursorLayer(PuzzleView *puzzleView)
+  : Layer(puzzleView)
+{
+  setPositionScheme(Wt::PositionScheme::Absolute);
+  setOffsets(Wt::WLength(0, Wt::LengthUnit::Pixel), Wt::Side::Top | Wt::Side::Left);
+}
+
+PuzzleView::CursorLayer::~CursorLayer() = default;
+
+void PuzzleView::CursorLayer::paintEvent(Wt::WPaintDevice *paintDevice)
+{
+  Wt::WPainter painter(paintDevice);
+
+  const Application *app = Application::instance();
+
+  const std::shared_ptr<const PresenceSnapshot> presence = app->dispatcher().presence(puzzleView_->puzzleId_);
+  if (presence) {
+    for (const UserCursor &cursor : presence->cursors) {
+      if (cursor.userId == app->user())
+        continue;
+      paintCursor(painter, cursor.userIndex, cursor.cellRef, cursor.direction);
+    }
+  }
+
+  if (puzzleView_->selectedCell_ != std::make_pair(-1, -1)) {
+    // pens are looked up by user index, this is ours
+    paintCursor(painter,
+                app->sharedSession().userRegistry().indexOf(app->user()),
+                puzzleView_->selectedCell_,
+                puzzleView_->direction_);
+  }
+}
+
+void PuzzleView::CursorLayer::paintCursor(Wt::WPainter &painter,
+                                          UserRegistry::Index userIndex,
+                                          CellRef cellRef,
+                                          Wt::Orientation direction) const
+{
+  const Application *app = Application::instance();
+
+  const Wt::WRectF square = geometry()->square(cellRef);
+  const double minSize = std::min(square.width(), square.height());
+
+  painter.setPen(app->userPen(userIndex));
+  painter.setBrush(Wt::BrushStyle::None);
+
+  const Wt::WPointF center = square.center();
+  const double diameter = minSize * zoom();
+  const Wt::WRectF rect = Wt::WRectF(center.x() * zoom() - diameter / 2.0,
+                                     center.y() * zoom() - diameter / 2.0,
+                                     diameter,
+                                     diameter);
+  painter.drawRect(rect);
+
+  Wt::WPainterPath directionArrow;
+  if (direction == Wt::Orientation::Horizontal) {
+    directionArrow.moveTo(rect.right(), rect.center().y() - diameter / 4.0);
+    directionArrow.lineTo(rect.right() + diameter / 4.0, rect.center().y());
+    directionArrow.lineTo(rect.right(), rect.center().y() + diameter / 4.0);
+    directionArrow.closeSubPath();
+  } else {
+    assert(direction == Wt::Orientation::Vertical);
+    directionArrow.moveTo(rect.center().x() - diameter / 4.0, rect.bottom());
+    directionArrow.lineTo(rect.center().x(), rect.bottom() + diameter / 4.0);
+    directionArrow.lineTo(rect.center().x() + diameter / 4.0, rect.bottom());
+    directionArrow.closeSubPath();
+  }
+  painter.fillPath(directionArrow, Wt::WBrush(painter.pen().color()));
+}
+
+void PuzzleView::TextLayer::paintLetter(Wt::WPainter &painter,
+                                        Wt::WFont &font,
+                                        CellRef cellRef) const
+{
+  if (puzzleView_->cellValues_.empty())
+    return;
+
+  const CellValue &value = puzzleView_->cellValue(cellRef);
+  if (value.character == Character::None)
+    return;
+
+  const Application *app = Application::instance();
+
+  const Wt::WRectF square = geometry()->square(cellRef);
+  const double minSize = std::min(square.width(), square.height());
+
+  font.setSize(Wt::WLength(0.7 * minSize * zoom()));
+  painter.setFont(font);
+
+  painter.setPen(app->userPen(value.user));
+  painter.setBrush(Wt::BrushStyle::None);
+
+  std::string str(charToStr(value.character));
+
+  painter.drawText(Wt::WTransform().scale(zoom(), zoom()).map(square),
+                   Wt::AlignmentFlag::Center |
+                   Wt::AlignmentFlag::Middle,
+                   Wt::TextFlag::SingleLine,
+                   Wt::utf8(str));
+}
+
+PuzzleView::ClientLayer::ClientLayer(PuzzleView *puzzleView)
+  : puzzleView_(puzzleView)
+{
+  setPositionScheme(Wt::PositionScheme::Absolute);
+  setOffsets(Wt::WLength(0, Wt::LengthUnit::Pixel), Wt::Side::Top | Wt::Side::Left);
+
+  std::ostringstream squares;
+  squares.imbue(std::locale::classic());
+  squares << '[';
+  for (int r = 0; r < geometry()->rowCount(); ++r) {
+    for (int c = 0; c < geometry()->colCount(); ++c) {
+      if (r != 0 || c != 0)
+        squares << ',';
+      if (geometry()->isNull({r, c})) {
+        squares << "null";
+      } else {
+        const Wt::WRectF square = geometry()->square({r, c});
+        squares << '[' << square.x() << ',' << square.y() << ','
+                << square.width() << ',' << square.height() << ']';
+      }
+    }
+  }
+  squares << ']';
+
+  Application *app = Application::instance();
+  app->requireJavaScriptFunction("clientLayer", client_layer_js);
+  doJavaScript(app->javaScriptClass() + ".clientLayer(" + jsRef() + "," +
+               std::to_string(geometry()->width()) + "," +
+               std::to_string(geometry()->height()) + "," +
+               squares.str() + ");");
+}
+
+PuzzleView::ClientLayer::~ClientLayer() = default;
+
+void PuzzleView::ClientLayer::update()
+{
+  const Application *app = Application::instance();
+
+  std::string letters = "{";
+  if (!puzzleView_->cellValues_.empty()) {
+    for (int r = 0; r < geometry()->rowCount(); ++r) {
+      for (int c = 0; c < geometry()->colCount(); ++c) {
+        if (geometry()->isNull({r, c}) ||
+            puzzleView_->cellValue({r, c}).character == Character::None) {
+          continue;
+        }
+        if (letters.size() > 1)
+          letters += ',';
+        letters += std::to_string(index({r, c})) + ":[" + letterArgs({r, c}) + "]";
+      }
+    }
+  }
+  letters += '}';
+
+  std::string cursors = "{";
+  const std::shared_ptr<const PresenceSnapshot> presence = app->dispatcher().presence(puzzleView_->puzzleId_);
+  if (presence) {
+    for (const UserCursor &cursor : presence->cursors) {
+      if (cursor.userId == app->user())
+        continue;
+      if (cursors.size() > 1)
+        cursors += ',';
+      cursors += std::to_string(cursor.userId) + ":[" + std::to_string(index(cursor.cellRef)) + "," +
+                 cursorArgs(cursor.userIndex, cursor.direction) + "]";
+    }
+  }
+  if (puzzleView_->selectedCell_ != std::make_pair(-1, -1)) {
+    if (cursors.size() > 1)
+      cursors += ',';
+    cursors += std::to_string(app->user()) + ":[" + std::to_string(index(puzzleView_->selectedCell_)) + "," +
+               cursorArgs(app->sharedSession().userRegistry().indexOf(app->user()), puzzleView_->direction_) + "]";
+  }
+  cursors += '}';
+
+  doJavaScript(jsRef() + ".swedish.setAll(" + letters + "," + cursors + ");");
+}
+
+void PuzzleView::ClientLayer::updateCell(CellRef cellRef)
+{
+  doJavaScript(jsRef() + ".swedish.setLetter(" + std::to_string(index(cellRef)) + "," + letterArgs(cellRef) + ");");
+}
+
+void PuzzleView::ClientLayer::updateCursor(long long userId,
+                                           UserRegistry::Index userIndex,
+                                           CellRef cellRef,
+                                           Wt::Orientation direction)
+{
+  const int i = cellRef == std::make_pair(-1, -1) ? -1 : index(cellRef);
+  doJavaScript(jsRef() + ".swedish.setCursor(" + std::to_string(userId) + "," + std::to_string(i) + "," +
+               cursorArgs(userIndex, direction) + ");");
+}
+
+void PuzzleView::ClientLayer::updateZoom()
+{
+  std::ostringstream ss;
+  ss.imbue(std::locale::classic());
+  ss << jsRef() << ".swedish.setZoom(" << puzzleView_->zoom_ << ");";
+  doJavaScript(ss.str());
+}
+
+std::string PuzzleView::ClientLayer::letterArgs(CellRef cellRef) const
+{
+  if (puzzleView_->cellValues_.empty())
+    return "'',''";
+
+  const CellValue &value = puzzleView_->cellValue(cellRef);
+  if (value.character == Character::None)
+    return "'',''";
+
+  const Application *app = Application::instance();
+  return "'" + std::string(charToStr(value.character)) + "','" + app->userPen(value.user).color().cssText() + "'";
+}
+
+std::string PuzzleView::ClientLayer::cursorArgs(UserRegistry::Index userIndex,
+                                                Wt::Orientation direction) const
+{
+  const Application *app = Application::instance();
+  return "'" + app->userPen(userIndex).color().cssText() + "'," +
+         (direction == Wt::Orientation::Vertical ? "true" : "false");
+}
+
 void PuzzleView::UndoBuffer::push(Entry entry)
 {
   if (bufLen_ == entries_.size()) {
@@ -293,8 +666,24 @@ std::optional<PuzzleView::UndoBuffer::Entry> PuzzleView::UndoBuffer::pop()
 
 PuzzleView::PuzzleView(const Wt::Dbo::ptr<Puzzle> &puzzle,
                        PuzzleViewType type)
+  : PuzzleView(puzzle.id(), puzzle, std::make_shared<const PuzzleGeometry>(*puzzle), type, PuzzleRendering::Server)
+{ }
+
+PuzzleView::PuzzleView(long long puzzleId,
+                       std::shared_ptr<const PuzzleGeometry> geometry,
+                       PuzzleRendering rendering)
+  : PuzzleView(puzzleId, Wt::Dbo::ptr<Puzzle>(), std::move(geometry), PuzzleViewType::SolvePuzzle, rendering)
+{ }
+
+PuzzleView::PuzzleView(long long puzzleId,
+                       const Wt::Dbo::ptr<Puzzle> &puzzle,
+                       std::shared_ptr<const PuzzleGeometry> geometry,
+                       PuzzleViewType type,
+                       PuzzleRendering rendering)
   : Wt::WCompositeWidget(std::make_unique<Wt::WContainerWidget>()),
+    puzzleId_(puzzleId),
     puzzle_(puzzle),
+    geometry_(std::move(geometry)),
     type_(type)
 {
   Application *app = Application::instance();
@@ -311,16 +700,26 @@ PuzzleView::PuzzleView(const Wt::Dbo::ptr<Puzzle> &puzzle,
   bottom->setOverflow(Wt::Overflow::Auto);
 
   paintedWidget_ = bottom->addNew<PuzzlePaintedWidget>(this);
-  textLayer_ = bottom->addNew<TextLayer>(this);
+  if (rendering == PuzzleRendering::Client) {
+    assert(type_ == PuzzleViewType::SolvePuzzle);
+    clientLayer_ = bottom->addNew<ClientLayer>(this);
+  } else {
+    textLayer_ = bottom->addNew<TextLayer>(this);
+  }
 
   const Wt::WEnvironment &env = app->environment();
   const int screenHeight = env.screenHeight();
   if (screenHeight != -1) {
-    zoom_ = (0.7 * screenHeight) / puzzle_->height;
+    zoom_ = (0.7 * screenHeight) / geometry_->height();
   }
 
-  paintedWidget_->resize(puzzle->width * zoom_, puzzle->height * zoom_);
-  textLayer_->resize(puzzle->width * zoom_, puzzle->height * zoom_);
+  paintedWidget_->resize(geometry_->width() * zoom_, geometry_->height() * zoom_);
+  if (clientLayer_) {
+    clientLayer_->resize(geometry_->width() * zoom_, geometry_->height() * zoom_);
+    clientLayer_->updateZoom();
+  } else {
+    textLayer_->resize(geometry_->width() * zoom_, geometry_->height() * zoom_);
+  }
 
   auto leftBtnGroup = top->addNew<Wt::WContainerWidget>();
   leftBtnGroup->addStyleClass("btn-group");
@@ -350,11 +749,12 @@ PuzzleView::PuzzleView(const Wt::Dbo::ptr<Puzzle> &puzzle,
         puzzle_.modify()->width = w;
         puzzle_.modify()->height = h;
         puzzle_.modify()->rotation = nextClockwise(puzzle_->rotation);
+        geometry_ = std::make_shared<const PuzzleGeometry>(*puzzle_);
 
-        paintedWidget_->resize(puzzle_->width * zoom_,
-                               puzzle_->height * zoom_);
-        textLayer_->resize(puzzle_->width * zoom_,
-                           puzzle_->height * zoom_);
+        paintedWidget_->resize(geometry_->width() * zoom_,
+                               geometry_->height() * zoom_);
+        textLayer_->resize(geometry_->width() * zoom_,
+                           geometry_->height() * zoom_);
       });
 
       rotateCCWBtn->clicked().connect([this]{
@@ -364,11 +764,12 @@ PuzzleView::PuzzleView(const Wt::Dbo::ptr<Puzzle> &puzzle,
         puzzle_.modify()->width = w;
         puzzle_.modify()->height = h;
         puzzle_.modify()->rotation = nextAntiClockwise(puzzle_->rotation);
+        geometry_ = std::make_shared<const PuzzleGeometry>(*puzzle_);
 
-        paintedWidget_->resize(puzzle_->width * zoom_,
-                               puzzle_->height * zoom_);
-        textLayer_->resize(puzzle_->width * zoom_,
-                           puzzle_->height * zoom_);
+        paintedWidget_->resize(geometry_->width() * zoom_,
+                               geometry_->height() * zoom_);
+        textLayer_->resize(geometry_->width() * zoom_,
+                           geometry_->height() * zoom_);
       });
     } else {
       assert(type_ == PuzzleViewType::SolvePuzzle);
@@ -390,12 +791,26 @@ PuzzleView::PuzzleView(const Wt::Dbo::ptr<Puzzle> &puzzle,
         changeDirection(Wt::Orientation::Vertical);
       });
 
+      if (!clientLayer_) {
+        cursorLayer_ = bottom->addNew<CursorLayer>(this);
+        cursorLayer_->resize(geometry_->width() * zoom_, geometry_->height() * zoom_);
+      }
+
+      cellStates_ = app->sharedSession().cellStates(puzzleId_);
+      resync();
+
       app->globalKeyWentDown().connect(this, &PuzzleView::handleKeyWentDown);
       app->subscriber().cellValueChanged().connect(this, &PuzzleView::handleCellValueChanged);
       app->subscriber().cursorMoved().connect(this, &PuzzleView::handleCursorMoved);
     }
 
-    textLayer_->clicked().connect(this, &PuzzleView::handleClick);
+    // the topmost layer gets the clicks
+    Wt::WInteractWidget *topLayer = textLayer_;
+    if (cursorLayer_)
+      topLayer = cursorLayer_;
+    else if (clientLayer_)
+      topLayer = clientLayer_;
+    topLayer->clicked().connect(this, &PuzzleView::handleClick);
   }
 
   app->globalKeyPressed().connect(this, &PuzzleView::handleKeyPressed);
@@ -414,7 +829,30 @@ PuzzleView::~PuzzleView() = default;
 
 void PuzzleView::update()
 {
+  if (clientLayer_) {
+    clientLayer_->update();
+    return;
+  }
+
   textLayer_->update();
+  if (cursorLayer_)
+    cursorLayer_->update();
+}
+
+void PuzzleView::resync()
+{
+  if (!cellStates_)
+    return;
+
+  cellValues_.clear();
+  cellValues_.reserve(static_cast<std::size_t>(geometry_->rowCount() * geometry_->colCount()));
+  for (int r = 0; r < geometry_->rowCount(); ++r) {
+    for (int c = 0; c < geometry_->colCount(); ++c) {
+      cellValues_.push_back(cellStates_->valueAt({r, c}));
+    }
+  }
+
+  update();
 }
 
 void PuzzleView::setClickedPoint(const Wt::WPointF &point)
@@ -437,7 +875,7 @@ void PuzzleView::setSelectedCell(CellRef cellRef)
   selectedCell_ = cellRef;
   Application *app = Application::instance();
   app->dispatcher().notifyCursorMoved(app->subscriber(),
-                                      puzzle_.id(),
+                                      puzzleId_,
                                       app->user(),
                                       cellRef,
                                       direction_);
@@ -457,10 +895,20 @@ void PuzzleView::setZoom(double zoom)
 {
   zoom_ = std::max(min_zoom, std::min(max_zoom, zoom));
 
-  paintedWidget_->resize(puzzle_->width * zoom_,
-                         puzzle_->height * zoom_);
-  textLayer_->resize(puzzle_->width * zoom_,
-                     puzzle_->height * zoom_);
+  paintedWidget_->resize(geometry_->width() * zoom_,
+                         geometry_->height() * zoom_);
+  if (clientLayer_) {
+    clientLayer_->resize(geometry_->width() * zoom_,
+                         geometry_->height() * zoom_);
+    clientLayer_->updateZoom();
+  } else {
+    textLayer_->resize(geometry_->width() * zoom_,
+                       geometry_->height() * zoom_);
+  }
+  if (cursorLayer_) {
+    cursorLayer_->resize(geometry_->width() * zoom_,
+                         geometry_->height() * zoom_);
+  }
 
   paintedWidget_->update();
 }
@@ -473,28 +921,11 @@ void PuzzleView::handleClick(const Wt::WMouseEvent &evt)
   const double y = coords.y / zoom_;
 
   if (type_ == PuzzleViewType::SolvePuzzle) {
-    CellRef closestCell = { -1,  -1};
-    double smallestDistance = -1;
-    for (std::size_t r = 0; r < puzzle_->rows_.size(); ++r) {
-      const auto &row = puzzle_->rows_[r];
-      for (std::size_t c = 0; c < row.size(); ++c) {
-        const auto &cell = row[c];
-        if (cell.square.contains(Wt::WPointF(x, y))) {
-          const Wt::WPointF center = cell.square.center();
-          const double distance = std::hypot(x - center.x(), y - center.y());
-          if (closestCell == std::make_pair( -1, -1 ) ||
-              distance < smallestDistance) {
-            closestCell = std::make_pair(static_cast<int>(r),
-                                         static_cast<int>(c));
-            smallestDistance = distance;
-          }
-        }
-      }
-    }
+    const CellRef closestCell = geometry_->cellAt(Wt::WPointF(x, y));
 
     setSelectedCell(closestCell);
 
-    textLayer_->update();
+    updateCursor();
   } else {
     assert(type_ == PuzzleViewType::SelectCell);
 
@@ -508,7 +939,8 @@ void PuzzleView::handleClick(const Wt::WMouseEvent &evt)
 
 void PuzzleView::handleKeyWentDown(const Wt::WKeyEvent &evt)
 {
-  if (selectedCell_ == std::make_pair(-1, -1)) {
+  if (selectedCell_ == std::make_pair(-1, -1) ||
+      !cellStates_) {
     return;
   }
 
@@ -522,19 +954,15 @@ void PuzzleView::handleKeyWentDown(const Wt::WKeyEvent &evt)
     if (undoEntry) {
       const auto entry = undoEntry.value();
 
-      const auto currentValue = app->sharedSession().charAt(puzzle_.id(), entry.cellRef);
-
-      if (currentValue == entry.after) {
-        app->sharedSession().updateChar(puzzle_.id(),
-                                        entry.cellRef,
-                                        entry.before.first,
-                                        entry.before.second);
+      const auto results = app->sharedSession().applyEdits(puzzleId_,
+                                                           {{entry.cellRef,
+                                                             entry.before.first,
+                                                             entry.before.second,
+                                                             entry.after.first,
+                                                             entry.after.second}});
 
-        app->dispatcher().notifyCellValueChanged(app->subscriber(),
-                                                 puzzle_.id(),
-                                                 entry.cellRef);
-
-        textLayer_->update();
+      if (results.front()) {
+        cellEdited(entry.cellRef);
       }
     }
 
@@ -542,19 +970,7 @@ void PuzzleView::handleKeyWentDown(const Wt::WKeyEvent &evt)
   }
 
   if (evt.key() == Wt::Key::Delete) {
-    const auto previousValue = app->sharedSession().updateChar(puzzle_.id(),
-                                                               selectedCell_,
-                                                               Character::None,
-                                                               app->user());
-    if (previousValue) {
-      undoBuffer_.push({selectedCell_, previousValue.value(), {Character::None, app->user()}});
-    }
-
-    app->dispatcher().notifyCellValueChanged(app->subscriber(),
-                                             puzzle_.id(),
-                                             selectedCell_);
-
-    textLayer_->update();
+    editAndAdvance({selectedCell_, Character::None, app->user(), std::nullopt, std::nullopt}, selectedCell_);
 
     return;
   }
@@ -565,91 +981,46 @@ void PuzzleView::handleKeyWentDown(const Wt::WKeyEvent &evt)
       return;
     }
 
-    const auto previousValue = app->sharedSession().updateChar(puzzle_.id(),
-                                                               previous,
-                                                               Character::None,
-                                                               app->user());
-
-    if (previousValue) {
-      undoBuffer_.push({previous, previousValue.value(), {Character::None, app->user()}});
+    if (!editAndAdvance({previous, Character::None, app->user(), std::nullopt, std::nullopt}, previous)) {
+      setSelectedCell(previous);
+      updateCursor();
     }
 
-    app->dispatcher().notifyCellValueChanged(app->subscriber(),
-                                             puzzle_.id(),
-                                             previous);
-
-    setSelectedCell(previous);
-
-    textLayer_->update();
-
     return;
   }
 
   if (evt.key() == Wt::Key::J) {
     const CellRef previous = nextCell(selectedCell_, direction_ == Wt::Orientation::Horizontal ? Direction::Left : Direction::Up);
     if (previous != selectedCell_ &&
-        app->sharedSession().charAt(puzzle_.id(), previous).first == Character::I) {
-      const auto previousValue = app->sharedSession().updateChar(puzzle_.id(),
-                                                                 previous,
-                                                                 Character::IJ,
-                                                                 app->user());
-
-      if (previousValue) {
-        undoBuffer_.push({previous, previousValue.value(), {Character::IJ, app->user()}});
-      }
-
-      app->dispatcher().notifyCellValueChanged(app->subscriber(),
-                                               puzzle_.id(),
-                                               previous);
-
-      textLayer_->update();
-
+        editAndAdvance({previous, Character::IJ, app->user(), Character::I, std::nullopt}, selectedCell_)) {
       return;
     }
     const CellRef next = immediateNextCell(selectedCell_, direction_ == Wt::Orientation::Horizontal ? Direction::Right : Direction::Down);
     if (next == std::make_pair(-1, -1) &&
-        app->sharedSession().charAt(puzzle_.id(), selectedCell_).first == Character::I) {
-
-      const auto previousValue = app->sharedSession().updateChar(puzzle_.id(),
-                                                                 selectedCell_,
-                                                                 Character::IJ,
-                                                                 app->user());
-
-      if (previousValue) {
-        undoBuffer_.push({selectedCell_, previousValue.value(), {Character::IJ, app->user()}});
-      }
-
-      app->dispatcher().notifyCellValueChanged(app->subscriber(),
-                                               puzzle_.id(),
-                                               selectedCell_);
-
-      auto newSelectedCell = nextCell(selectedCell_, direction_ == Wt::Orientation::Horizontal ? Direction::Right : Direction::Down);
-      setSelectedCell(newSelectedCell);
-
-      textLayer_->update();
-
+        editAndAdvance({selectedCell_, Character::IJ, app->user(), Character::I, std::nullopt},
+                       nextCell(selectedCell_, direction_ == Wt::Orientation::Horizontal ? Direction::Right : Direction::Down))) {
       return;
     }
   }
 
   if (evt.key() == Wt::Key::Up) {
     setSelectedCell(nextCell(selectedCell_, Direction::Up));
-    textLayer_->update();
+    updateCursor();
     return;
   }
   if (evt.key() == Wt::Key::Right) {
     setSelectedCell(nextCell(selectedCell_, Direction::Right));
-    textLayer_->update();
+    updateCursor();
     return;
   }
   if (evt.key() == Wt::Key::Down) {
     setSelectedCell(nextCell(selectedCell_, Direction::Down));
-    textLayer_->update();
+    updateCursor();
     return;
   }
   if (evt.key() == Wt::Key::Left) {
     setSelectedCell(nextCell(selectedCell_, Direction::Left));
-    textLayer_->update();
+    updateCursor();
     return;
   }
 
@@ -662,23 +1033,47 @@ void PuzzleView::handleKeyWentDown(const Wt::WKeyEvent &evt)
     s += static_cast<char>(keyI);
 
     const Character ch = strToChar(s);
-    const auto previousValue = app->sharedSession().updateChar(puzzle_.id(),
-                                                               selectedCell_,
-                                                               ch,
-                                                               app->user());
-
-    if (previousValue) {
-      undoBuffer_.push({selectedCell_, previousValue.value(), {ch, app->user()}});
+    const CellRef next = nextCell(selectedCell_, direction_ == Wt::Orientation::Horizontal ? Direction::Right : Direction::Down);
+    if (!editAndAdvance({selectedCell_, ch, app->user(), std::nullopt, std::nullopt}, next)) {
+      setSelectedCell(next);
+      updateCursor();
     }
+  }
+}
 
-    app->dispatcher().notifyCellValueChanged(app->subscriber(),
-                                             puzzle_.id(),
-                                             selectedCell_);
+bool PuzzleView::editAndAdvance(const CellEdit &edit, CellRef nextCellRef)
+{
+  Application *app = Application::instance();
 
-    setSelectedCell(nextCell(selectedCell_, direction_ == Wt::Orientation::Horizontal ? Direction::Right : Direction::Down));
+  const auto previousValue = app->sharedSession().applyEdits(puzzleId_, {edit}).front();
+  if (!previousValue)
+    return false;
 
-    textLayer_->update();
+  undoBuffer_.push({edit.cellRef, previousValue.value(), {edit.character, edit.user}});
+
+  const CellValue value = cellStates_->valueAt(edit.cellRef);
+  setCellValue(edit.cellRef, value);
+
+  if (nextCellRef == selectedCell_) {
+    app->dispatcher().notifyCellValueChanged(app->subscriber(),
+                                             puzzleId_,
+                                             edit.cellRef,
+                                             value);
+    return true;
   }
+
+  // the other viewers get the edit and the cursor move in one event
+  selectedCell_ = nextCellRef;
+  app->dispatcher().notifyCellEdited(app->subscriber(),
+                                     puzzleId_,
+                                     edit.cellRef,
+                                     value,
+                                     app->user(),
+                                     selectedCell_,
+                                     direction_);
+  updateCursor();
+
+  return true;
 }
 
 void PuzzleView::handleKeyPressed(const Wt::WKeyEvent &evt)
@@ -714,38 +1109,96 @@ void PuzzleView::changeDirection(Wt::Orientation direction)
   horizontalBtn_->toggleStyleClass("active", direction_ == Wt::Orientation::Horizontal);
   verticalBtn_->toggleStyleClass("active", direction_ == Wt::Orientation::Vertical);
 
-  textLayer_->update();
+  updateCursor();
 
   Application *app = Application::instance();
   app->dispatcher().notifyCursorMoved(app->subscriber(),
-                                      puzzle_.id(),
+                                      puzzleId_,
                                       app->user(),
                                       selectedCell_,
                                       direction_);
 }
 
-void PuzzleView::handleCellValueChanged(long long puzzleId,
-                                        CellRef cellRef)
+const CellValue &PuzzleView::cellValue(CellRef cellRef) const
+{
+  return cellValues_[static_cast<std::size_t>(cellRef.first * geometry_->colCount() + cellRef.second)];
+}
+
+void PuzzleView::setCellValue(CellRef cellRef, const CellValue &value)
 {
-  (void) cellRef;
+  CellValue &shown = cellValues_[static_cast<std::size_t>(cellRef.first * geometry_->colCount() + cellRef.second)];
 
-  if (puzzleId != puzzle_->id()) {
+  // events of different senders may arrive out of order
+  if (value.version <= shown.version)
+    return;
+
+  shown = value;
+  if (clientLayer_)
+    clientLayer_->updateCell(cellRef);
+  else
+    textLayer_->updateCell(cellRef);
+}
+
+void PuzzleView::updateCursor()
+{
+  if (!clientLayer_) {
+    cursorLayer_->update();
     return;
   }
 
-  textLayer_->update();
+  const Application *app = Application::instance();
+  clientLayer_->updateCursor(app->user(),
+                             app->sharedSession().userRegistry().indexOf(app->user()),
+                             selectedCell_,
+                             direction_);
+}
+
+void PuzzleView::cellEdited(CellRef cellRef)
+{
+  const CellValue value = cellStates_->valueAt(cellRef);
 
-  Application::instance()->triggerUpdate();
+  setCellValue(cellRef, value);
+
+  Application *app = Application::instance();
+  app->dispatcher().notifyCellValueChanged(app->subscriber(),
+                                           puzzleId_,
+                                           cellRef,
+                                           value);
 }
 
-void PuzzleView::handleCursorMoved([[maybe_unused]] long long puzzleId,
-                                   [[maybe_unused]] long long userId,
-                                   [[maybe_unused]] CellRef cellRef,
-                                   [[maybe_unused]] Wt::Orientation direction)
+void PuzzleView::handleCellValueChanged(long long puzzleId,
+                                        CellRef cellRef,
+                                        const CellValue &value)
 {
-  textLayer_->update();
+  if (puzzleId != puzzleId_ ||
+      cellValues_.empty()) {
+    return;
+  }
 
-  Application::instance()->triggerUpdate();
+  setCellValue(cellRef, value);
+}
+
+void PuzzleView::handleCursorMoved(long long puzzleId,
+                                   long long userId,
+                                   CellRef cellRef,
+                                   Wt::Orientation direction)
+{
+  if (!clientLayer_) {
+    cursorLayer_->update();
+    return;
+  }
+
+  const Application *app = Application::instance();
+  if (userId == app->user())
+    return; // we only show our own cursor in this session
+
+  if (puzzleId != puzzleId_)
+    cellRef = { -1, -1 }; // moved to another puzzle
+
+  clientLayer_->updateCursor(userId,
+                             app->sharedSession().userRegistry().indexOf(userId),
+                             cellRef,
+                             direction);
 }
 
 PuzzleView::CellRef PuzzleView::nextCell(CellRef cellRef, Direction direction) const
@@ -757,57 +1210,11 @@ PuzzleView::CellRef PuzzleView::nextCell(CellRef cellRef, Direction direction) c
   assert(cellRef.first >= 0 &&
          cellRef.second >= 0);
 
-  const auto [r, c] = cellRef;
-
-  const auto &row = puzzle_->rows_[static_cast<std::size_t>(r)];
-  const int rowCount = static_cast<int>(puzzle_->rows_.size());
-  const int colCount = static_cast<int>(row.size());
-
-  if (direction == Direction::Up) {
-    int nextRowUp = r - 1;
-    while (nextRowUp >= 0 &&
-           puzzle_->cell(nextRowUp, c).isNull()) {
-      --nextRowUp;
-    }
-    if (nextRowUp < 0) {
-      return cellRef;
-    } else {
-      return std::make_pair(nextRowUp, c);
-    }
-  } else if (direction == Direction::Right) {
-    int nextColRight = c + 1;
-    while (nextColRight < colCount &&
-           puzzle_->cell(r, nextColRight).isNull()) {
-      ++nextColRight;
-    }
-    if (nextColRight == colCount) {
-      return cellRef;
-    } else {
-      return std::make_pair(r, nextColRight);
-    }
-  } else if (direction == Direction::Down) {
-    int nextRowDown = r + 1;
-    while (nextRowDown < rowCount &&
-           puzzle_->cell(nextRowDown, c).isNull()) {
-      ++nextRowDown;
-    }
-    if (nextRowDown == rowCount) {
-      return cellRef;
-    } else {
-      return std::make_pair(nextRowDown, c);
-    }
+  const CellRef next = geometry_->nextCell(cellRef, direction);
+  if (next == std::make_pair(-1, -1)) {
+    return cellRef;
   } else {
-    assert(direction == Direction::Left);
-    int nextColLeft = c - 1;
-    while (nextColLeft >= 0 &&
-           puzzle_->cell(r, nextColLeft).isNull()) {
-      --nextColLeft;
-    }
-    if (nextColLeft < 0) {
-      return cellRef;
-    } else {
-      return std::make_pair(r, nextColLeft);
-    }
+    return next;
   }
 }
 
@@ -823,46 +1230,7 @@ PuzzleView::CellRef PuzzleView::immediateNextCell(CellRef cellRef,
   assert(cellRef.first >= 0 &&
          cellRef.second >= 0);
 
-  const auto [r, c] = cellRef;
-
-  const auto &row = puzzle_->rows_[static_cast<std::size_t>(r)];
-  const int rowCount = static_cast<int>(puzzle_->rows_.size());
-  const int colCount = static_cast<int>(row.size());
-
-  if (direction == Direction::Up) {
-    const int nextRowUp = r - 1;
-    if (nextRowUp >= 0 &&
-        !puzzle_->cell(nextRowUp, c).isNull()) {
-      return std::make_pair(nextRowUp, c);
-    } else {
-      return std::make_pair(-1, -1);
-    }
-  } else if (direction == Direction::Right) {
-    const int nextColRight = c + 1;
-    if (nextColRight < colCount &&
-        !puzzle_->cell(r, nextColRight).isNull()) {
-      return std::make_pair(r, nextColRight);
-    } else {
-      return std::make_pair(-1, -1);
-    }
-  } else if (direction == Direction::Down) {
-    const int nextRowDown = r + 1;
-    if (nextRowDown < rowCount &&
-        !puzzle_->cell(nextRowDown, c).isNull()) {
-      return std::make_pair(nextRowDown, c);
-    } else {
-      return std::make_pair(-1, -1);
-    }
-  } else {
-    assert(direction == Direction::Left);
-    const int nextColLeft = c - 1;
-    if (nextColLeft >= 0 &&
-        !puzzle_->cell(r, nextColLeft).isNull()) {
-      return std::make_pair(r, nextColLeft);
-    } else {
-      return std::make_pair(-1, -1);
-    }
-  }
+  return geometry_->adjacentCell(cellRef, direction);
 }
 
 }
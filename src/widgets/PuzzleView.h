@@ -4,38 +4,59 @@
 
 #pragma once
 
+#include "../CellStates.h"
 #include "../Direction.h"
 
 #include "../model/Puzzle.h"
+#include "../model/PuzzleGeometry.h"
 
 #include <Wt/WCompositeWidget.h>
 #include <Wt/WPointF.h>
 #include <Wt/WSignal.h>
 
 #include <array>
+#include <memory>
 #include <optional>
+#include <vector>
 
 namespace swedish {
 
+struct CellEdit;
+
 enum class PuzzleViewType {
   SelectCell,
   ViewCells,
   SolvePuzzle
 };
 
+enum class PuzzleRendering {
+  Server, // the letters and cursors are painted by the server
+  Client // the browser draws them, the server only sends what changed
+};
+
 class PuzzleView final : public Wt::WCompositeWidget {
 public:
+  // for a puzzle that is being uploaded
   PuzzleView(const Wt::Dbo::ptr<Puzzle> &puzzle,
              PuzzleViewType type);
+  // for solving a saved puzzle, with the geometry shared by SharedSession
+  PuzzleView(long long puzzleId,
+             std::shared_ptr<const PuzzleGeometry> geometry,
+             PuzzleRendering rendering = PuzzleRendering::Server);
   ~PuzzleView() override;
 
   void update();
 
+  // reloads all cells, after events for this view were dropped
+  void resync();
+
   void setClickedPoint(const Wt::WPointF &point);
 
   Wt::Signal<Wt::WPointF> &clickPositionChanged() { return clickPositionChanged_; }
 
 private:
+  class ClientLayer;
+  class CursorLayer;
   class Layer;
   class PuzzlePaintedWidget;
   class TextLayer;
@@ -60,9 +81,15 @@ private:
   };
   UndoBuffer undoBuffer_;
 
-  Wt::Dbo::ptr<Puzzle> puzzle_;
+  long long puzzleId_;
+  Wt::Dbo::ptr<Puzzle> puzzle_; // only while uploading
+  std::shared_ptr<const PuzzleGeometry> geometry_;
+  std::shared_ptr<const CellStates> cellStates_;
+  std::vector<CellValue> cellValues_; // row major, as shown, kept up to date by the events
   PuzzlePaintedWidget *paintedWidget_ = nullptr;
   TextLayer *textLayer_ = nullptr;
+  CursorLayer *cursorLayer_ = nullptr; // only when solving
+  ClientLayer *clientLayer_ = nullptr; // instead of the other layers, with PuzzleRendering::Client
   CellRef selectedCell_ = { -1, -1 };
   Wt::Signal<Wt::WPointF> clickPositionChanged_;
   std::optional<Wt::WPointF> clickPosition_;
@@ -73,8 +100,16 @@ private:
   PuzzleViewType type_;
   Wt::Orientation direction_ = Wt::Orientation::Horizontal;
 
+  PuzzleView(long long puzzleId,
+             const Wt::Dbo::ptr<Puzzle> &puzzle,
+             std::shared_ptr<const PuzzleGeometry> geometry,
+             PuzzleViewType type,
+             PuzzleRendering rendering);
+
   Wt::WContainerWidget *impl();
   void setSelectedCell(CellRef cellRef);
+  // shows our own cursor where it is now
+  void updateCursor();
   void zoomIn();
   void zoomOut();
   void setZoom(double zoom);
@@ -82,7 +117,16 @@ private:
   void handleKeyWentDown(const Wt::WKeyEvent &evt);
   void handleKeyPressed(const Wt::WKeyEvent &evt);
   void changeDirection(Wt::Orientation direction);
-  void handleCellValueChanged(long long puzzleId, CellRef cellRef);
+  const CellValue &cellValue(CellRef cellRef) const;
+  // shows the value, unless a newer one is shown already
+  void setCellValue(CellRef cellRef, const CellValue &value);
+  // shows our own edit, and sends it to the other viewers
+  void cellEdited(CellRef cellRef);
+  // Applies the edit and moves the cursor to nextCellRef as one operation,
+  // the other viewers get both in one event. Returns false, without moving,
+  // if the edit didn't change anything.
+  bool editAndAdvance(const CellEdit &edit, CellRef nextCellRef);
+  void handleCellValueChanged(long long puzzleId, CellRef cellRef, const CellValue &value);
   void handleCursorMoved(long long puzzleId,
                          long long userId,
                          CellRef cellRef,